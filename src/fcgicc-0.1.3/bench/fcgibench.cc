@@ -0,0 +1,543 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ */
+
+/*
+
+$ ./fcgibench [options] host:port
+$ ./fcgibench [options] /path/to/socket
+
+Keeps a FastCGI application busy with requests for a while, speaking the
+protocol directly over TCP or a local socket, then reports throughput and
+latency percentiles.
+
+    -c N    connections (16)
+    -m N    requests in flight on each connection, under distinct IDs (1)
+    -b N    bytes of standard input with each request (0)
+    -r N    requests per second over all connections, 0 is as many as the
+            application answers (0)
+    -d N    seconds to run (10)
+    -t N    threads, which share the connections (1)
+    -u URI  REQUEST_URI and SCRIPT_NAME to send (/)
+    -n      no keep-alive, a new connection for every request (implies -m 1)
+
+With -r, requests are sent on a fixed schedule and each one is timed from
+when it was due rather than from when it could be sent, so that an
+application that stalls is charged for every request it held up instead of
+slowing the benchmark down to its pace (coordinated omission).  Without -r
+the latencies only describe the requests that made it out.
+
+Responses that begin with a 5xx Status header, as an application shedding
+load sends, are counted as rejected, apart from the rest.
+
+*/
+
+
+#include <fcgicc.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fastcgi.h>
+
+
+struct Options {
+    Options() :
+        connections(16), multiplex(1), body(0), rate(0), seconds(10),
+        threads(1), uri("/"), keep_alive(true) {}
+
+    unsigned connections;
+    unsigned multiplex;
+    unsigned body;
+    double rate;
+    double seconds;
+    unsigned threads;
+    std::string uri;
+    bool keep_alive;
+    std::string target;
+};
+
+
+static unsigned long long
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void
+encode_size(std::string& params, std::string::size_type n)
+{
+    if (n >> 7 == 0)
+        params.push_back(static_cast<char>(n));
+    else {
+        params.push_back(static_cast<char>(n >> 24 | 0x80));
+        params.push_back(static_cast<char>(n >> 16));
+        params.push_back(static_cast<char>(n >> 8));
+        params.push_back(static_cast<char>(n));
+    }
+}
+
+
+static void
+encode_pair(std::string& params, const std::string& name,
+            const std::string& value)
+{
+    encode_size(params, name.size());
+    encode_size(params, value.size());
+    params.append(name);
+    params.append(value);
+}
+
+
+// One request of the benchmark with request ID 0, and where the IDs go
+class RequestTemplate {
+public:
+    RequestTemplate(const Options& options) {
+        FCGI_BeginRequestBody begin;
+        bzero(&begin, sizeof(begin));
+        begin.roleB0 = FCGI_RESPONDER;
+        begin.flags = options.keep_alive ? FCGI_KEEP_CONN : 0;
+        record(FCGI_BEGIN_REQUEST, reinterpret_cast<const char*>(&begin),
+            sizeof(begin));
+
+        char length[16];
+        snprintf(length, sizeof(length), "%u", options.body);
+        std::string params;
+        encode_pair(params, "REQUEST_METHOD", options.body ? "POST" : "GET");
+        encode_pair(params, "REQUEST_URI", options.uri);
+        encode_pair(params, "SCRIPT_NAME", options.uri);
+        encode_pair(params, "SERVER_PROTOCOL", "HTTP/1.1");
+        encode_pair(params, "CONTENT_LENGTH", length);
+        record(FCGI_PARAMS, params.data(), params.size());
+        record(FCGI_PARAMS, 0, 0);
+
+        std::string in(options.body, 'x');
+        for (std::string::size_type i = 0; i < in.size(); i += 0xfff8)
+            record(FCGI_STDIN, in.data() + i,
+                std::min(in.size() - i, (std::string::size_type)0xfff8));
+        record(FCGI_STDIN, 0, 0);
+    }
+
+    void append(std::string& out, unsigned id) const {
+        std::string::size_type base = out.size();
+        out.append(bytes);
+        for (std::vector<std::string::size_type>::const_iterator it =
+                headers.begin(); it != headers.end(); ++it) {
+            out[base + *it + 2] = static_cast<char>(id >> 8);
+            out[base + *it + 3] = static_cast<char>(id);
+        }
+    }
+
+private:
+    void record(unsigned char type, const char* data,
+                std::string::size_type n) {
+        FCGI_Header header;
+        bzero(&header, sizeof(header));
+        header.version = FCGI_VERSION_1;
+        header.type = type;
+        header.contentLengthB1 = n >> 8;
+        header.contentLengthB0 = n & 0xff;
+        header.paddingLength = (8 - n % 8) % 8;
+
+        headers.push_back(bytes.size());
+        bytes.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        bytes.append(data, n);
+        bytes.append(header.paddingLength, '\0');
+    }
+
+    std::string bytes;
+    std::vector<std::string::size_type> headers;
+};
+
+
+// A share of the connections, driven by one thread
+class Worker {
+public:
+    Worker(const Options& p_options, const RequestTemplate& p_request,
+           unsigned connections, double rate) :
+        completed(0),
+        errors(0),
+        rejected(0),
+        received(0),
+        options(p_options),
+        request(p_request),
+        conns(connections),
+        interval(rate > 0 ? 1e9 * connections / rate : 0)
+    {
+        for (std::vector<Conn>::iterator it = conns.begin();
+                it != conns.end(); ++it)
+            it->slots.resize(options.multiplex);
+    }
+
+    void run(unsigned long long start, unsigned long long end) {
+        // spread the first requests of the connections over one interval
+        for (std::vector<Conn>::size_type i = 0; i < conns.size(); i++)
+            conns[i].next_due = start + interval * i / conns.size();
+
+        std::vector<struct pollfd> fds(conns.size());
+        for (;;) {
+            unsigned long long t = now();
+            if (t >= end)
+                break;
+
+            int timeout = 100;
+            for (std::vector<Conn>::size_type i = 0; i < conns.size(); i++) {
+                Conn& conn = conns[i];
+                fill(conn, t);
+                if (interval && conn.in_flight < options.multiplex)
+                    timeout = std::min<long long>(timeout,
+                        conn.next_due > t ? (conn.next_due - t) / 1000000 : 0);
+                fds[i].fd = conn.fd;
+                fds[i].events = conn.fd == -1 ? 0 :
+                    POLLIN | (conn.out_pos < conn.out.size() ? POLLOUT : 0);
+                fds[i].revents = 0;
+            }
+
+            if (poll(fds.data(), fds.size(), timeout) == -1) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("poll() failed");
+            }
+            for (std::vector<Conn>::size_type i = 0; i < conns.size(); i++) {
+                if (fds[i].revents & POLLOUT)
+                    flush(conns[i]);
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    receive(conns[i]);
+            }
+        }
+
+        for (std::vector<Conn>::iterator it = conns.begin();
+                it != conns.end(); ++it)
+            if (it->fd != -1)
+                close(it->fd);
+    }
+
+    FastCGIHistogram latency;
+    unsigned long long completed;
+    unsigned long long errors;
+    unsigned long long rejected; // answered with a 5xx status
+    unsigned long long received;
+
+private:
+    struct Slot {
+        Slot() : busy(false), start(0), answered(false), rejected(false) {}
+
+        bool busy;
+        unsigned long long start;
+        bool answered; // some output has arrived
+        bool rejected;
+    };
+
+    struct Conn {
+        Conn() : fd(-1), out_pos(0), in_flight(0), next_due(0) {}
+
+        int fd;
+        std::string out;
+        std::string::size_type out_pos;
+        std::string in;
+        std::vector<Slot> slots; // by request ID - 1
+        unsigned in_flight;
+        unsigned long long next_due;
+    };
+
+    // sends whatever is due, opening the connection if it has to
+    void fill(Conn& conn, unsigned long long t) {
+        while (conn.in_flight < options.multiplex &&
+                (!interval || conn.next_due <= t)) {
+            if (conn.fd == -1)
+                conn.fd = connect_target();
+
+            unsigned id = 0;
+            while (conn.slots[id].busy)
+                id++;
+            conn.slots[id].busy = true;
+            conn.slots[id].start = interval ? conn.next_due : t;
+            conn.slots[id].answered = conn.slots[id].rejected = false;
+            conn.in_flight++;
+            request.append(conn.out, id + 1);
+            conn.next_due += interval;
+        }
+        if (conn.out_pos < conn.out.size())
+            flush(conn);
+    }
+
+    void flush(Conn& conn) {
+        while (conn.out_pos < conn.out.size()) {
+            ssize_t result = send(conn.fd, conn.out.data() + conn.out_pos,
+                conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+            if (result == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                lost(conn);
+                return;
+            }
+            conn.out_pos += result;
+        }
+        conn.out.clear();
+        conn.out_pos = 0;
+    }
+
+    void receive(Conn& conn) {
+        char buffer[65536];
+        for (;;) {
+            ssize_t result = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (result == -1 && errno == EINTR)
+                continue;
+            if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (result <= 0) {
+                lost(conn);
+                return;
+            }
+            conn.in.append(buffer, result);
+            if (!parse(conn))
+                return;
+        }
+    }
+
+    // false once the connection has been closed
+    bool parse(Conn& conn) {
+        std::string::size_type n = 0;
+        while (conn.in.size() - n >= sizeof(FCGI_Header)) {
+            const FCGI_Header& header =
+                *reinterpret_cast<const FCGI_Header*>(conn.in.data() + n);
+            std::string::size_type length =
+                (header.contentLengthB1 << 8) + header.contentLengthB0;
+            if (conn.in.size() - n <
+                    sizeof(FCGI_Header) + length + header.paddingLength)
+                break;
+            unsigned id = (header.requestIdB1 << 8) + header.requestIdB0;
+
+            if (header.type == FCGI_STDOUT) {
+                received += length;
+                if (length != 0 && id >= 1 && id <= conn.slots.size() &&
+                        !conn.slots[id - 1].answered) {
+                    // as an overloaded application sheds it
+                    static const char status[] = "Status: 5";
+                    conn.slots[id - 1].answered = true;
+                    conn.slots[id - 1].rejected =
+                        length >= sizeof(status) - 1 &&
+                        memcmp(conn.in.data() + n + sizeof(FCGI_Header),
+                            status, sizeof(status) - 1) == 0;
+                }
+            } else if (header.type == FCGI_END_REQUEST && id >= 1 &&
+                    id <= conn.slots.size() && conn.slots[id - 1].busy) {
+                const FCGI_EndRequestBody& body =
+                    *reinterpret_cast<const FCGI_EndRequestBody*>(
+                        conn.in.data() + n + sizeof(FCGI_Header));
+                if ((body.appStatusB3 | body.appStatusB2 | body.appStatusB1 |
+                        body.appStatusB0) != 0 ||
+                        body.protocolStatus != FCGI_REQUEST_COMPLETE)
+                    errors++;
+                if (conn.slots[id - 1].rejected)
+                    rejected++;
+                latency.record(now() - conn.slots[id - 1].start);
+                completed++;
+                conn.slots[id - 1].busy = false;
+                conn.in_flight--;
+            }
+            n += sizeof(FCGI_Header) + length + header.paddingLength;
+        }
+        conn.in.erase(0, n);
+
+        if (!options.keep_alive && conn.in_flight == 0) {
+            // the application closes it, don't wait for that
+            close(conn.fd);
+            conn.fd = -1;
+            conn.in.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // the application went away with requests outstanding
+    void lost(Conn& conn) {
+        errors += conn.in_flight;
+        for (std::vector<Slot>::iterator it = conn.slots.begin();
+                it != conn.slots.end(); ++it)
+            it->busy = false;
+        conn.in_flight = 0;
+        close(conn.fd);
+        conn.fd = -1;
+        conn.in.clear();
+        conn.out.clear();
+        conn.out_pos = 0;
+    }
+
+    int connect_target() {
+        int fd;
+        if (options.target.find('/') != std::string::npos) {
+            struct sockaddr_un sa;
+            bzero(&sa, sizeof(sa));
+            sa.sun_family = AF_UNIX;
+            if (options.target.size() >= sizeof(sa.sun_path))
+                throw std::runtime_error("socket path too long");
+            options.target.copy(sa.sun_path, sizeof(sa.sun_path) - 1);
+            fd = socket(PF_UNIX, SOCK_STREAM, 0);
+            if (fd == -1)
+                throw std::runtime_error("socket() failed");
+            if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+                close(fd);
+                throw std::runtime_error("connect() failed");
+            }
+        } else {
+            std::string::size_type colon = options.target.rfind(':');
+            if (colon == std::string::npos)
+                throw std::runtime_error("target is not host:port or a path");
+            std::string host(options.target, 0, colon);
+            std::string port(options.target, colon + 1);
+
+            struct addrinfo hints, *found;
+            bzero(&hints, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+                throw std::runtime_error("getaddrinfo() failed");
+            fd = socket(found->ai_family, SOCK_STREAM, 0);
+            if (fd == -1) {
+                freeaddrinfo(found);
+                throw std::runtime_error("socket() failed");
+            }
+            int connect_result = connect(fd, found->ai_addr,
+                found->ai_addrlen);
+            freeaddrinfo(found);
+            if (connect_result == -1) {
+                close(fd);
+                throw std::runtime_error("connect() failed");
+            }
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        return fd;
+    }
+
+    const Options& options;
+    const RequestTemplate& request;
+    std::vector<Conn> conns;
+    unsigned long long interval; // between requests of one connection, ns
+};
+
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: fcgibench [-c connections] [-m in_flight] "
+        "[-b body_bytes] [-r rate]\n"
+        "                 [-d seconds] [-t threads] [-u uri] [-n] "
+        "host:port | path\n");
+    exit(2);
+}
+
+
+int
+main(int argc, char** argv)
+{
+    Options options;
+    int option;
+    while ((option = getopt(argc, argv, "c:m:b:r:d:t:u:n")) != -1)
+        switch (option) {
+        case 'c': options.connections = atoi(optarg); break;
+        case 'm': options.multiplex = atoi(optarg); break;
+        case 'b': options.body = atoi(optarg); break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'd': options.seconds = atof(optarg); break;
+        case 't': options.threads = atoi(optarg); break;
+        case 'u': options.uri = optarg; break;
+        case 'n': options.keep_alive = false; break;
+        default: usage();
+        }
+    if (optind + 1 != argc || options.connections == 0 ||
+            options.multiplex == 0 || options.multiplex > 0xffff ||
+            options.threads == 0 || options.seconds <= 0)
+        usage();
+    options.target = argv[optind];
+    if (!options.keep_alive)
+        options.multiplex = 1;
+    options.threads = std::min(options.threads, options.connections);
+
+    RequestTemplate request(options);
+    std::vector<Worker*> workers;
+    for (unsigned i = 0; i < options.threads; i++) {
+        unsigned share = options.connections / options.threads +
+            (i < options.connections % options.threads);
+        workers.push_back(new Worker(options, request, share,
+            options.rate * share / options.connections));
+    }
+
+    unsigned long long start = now();
+    unsigned long long end = start + options.seconds * 1e9;
+    std::vector<std::thread> threads;
+    std::vector<std::string> failures(workers.size());
+    for (std::vector<Worker*>::size_type i = 0; i < workers.size(); i++)
+        threads.push_back(std::thread([&, i] {
+            try {
+                workers[i]->run(start, end);
+            } catch (const std::exception& e) {
+                failures[i] = e.what();
+            }
+        }));
+    for (std::vector<std::thread>::iterator it = threads.begin();
+            it != threads.end(); ++it)
+        it->join();
+    double elapsed = (now() - start) / 1e9;
+
+    FastCGIHistogram latency;
+    unsigned long long completed = 0, errors = 0, rejected = 0, received = 0;
+    for (std::vector<Worker*>::iterator it = workers.begin();
+            it != workers.end(); ++it) {
+        latency.merge((*it)->latency);
+        completed += (*it)->completed;
+        errors += (*it)->errors;
+        rejected += (*it)->rejected;
+        received += (*it)->received;
+        delete *it;
+    }
+    for (std::vector<std::string>::iterator it = failures.begin();
+            it != failures.end(); ++it)
+        if (!it->empty()) {
+            fprintf(stderr, "Error: %s\n", it->c_str());
+            return 1;
+        }
+
+    printf("%u connections, %u in flight each, %u byte bodies, %s\n",
+        options.connections, options.multiplex, options.body,
+        options.keep_alive ? "keep-alive" : "no keep-alive");
+    printf("requests  %llu in %.2f s, %.1f per second, %llu errors\n",
+        completed, elapsed, completed / elapsed, errors);
+    if (rejected)
+        printf("rejected  %llu with a 5xx status, %.1f per second answered "
+            "otherwise\n", rejected, (completed - rejected) / elapsed);
+    printf("received  %.2f MB, %.2f MB per second\n",
+        received / 1e6, received / 1e6 / elapsed);
+    printf("latency   p50 %.1f us, p90 %.1f us, p99 %.1f us, "
+        "p99.9 %.1f us, max %.1f us%s\n",
+        latency.percentile(50) / 1e3, latency.percentile(90) / 1e3,
+        latency.percentile(99) / 1e3, latency.percentile(99.9) / 1e3,
+        latency.percentile(100) / 1e3,
+        options.rate > 0 ? "" : " (closed loop)");
+    return errors != 0;
+}
@@ -0,0 +1,314 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ */
+
+/*
+
+$ ./fcgimicro [-d seconds] [case...]
+
+Runs the parsing and framing code of FastCGIServer in-process, without
+sockets, on requests like nginx sends them, and prints the time and the
+number of allocations each call takes.  Cases are selected by name prefix,
+all of them by default, and each one runs for the given time (0.5).
+
+    params/...   FastCGIParams::parse, as every request's parameters are
+    parse_pairs  the same block into a map, as for FCGI_GET_VALUES
+    write_pair   encoding the block
+    write_data/  framing a response body and taking it off the queue, with
+                 the handler's copy of it
+    read/...     a whole request, from its records arriving in the input
+                 buffer through the handler to its response leaving
+
+*/
+
+
+#include <fcgicc.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include <fastcgi.h>
+
+
+// this program only calls new from one thread
+static unsigned long long allocations;
+
+
+void*
+operator new(std::size_t n)
+{
+    allocations++;
+    void* p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+
+void*
+operator new[](std::size_t n)
+{
+    return operator new(n);
+}
+
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, std::size_t) noexcept { free(p); }
+void operator delete[](void* p, std::size_t) noexcept { free(p); }
+
+
+// The parameters of a browser's GET request, as nginx passes them with the
+// stock fastcgi_params and SCRIPT_FILENAME, in its order
+static const char* const nginx_params[][2] = {
+    { "SCRIPT_FILENAME", "/var/www/app/index.fcgi" },
+    { "QUERY_STRING", "page=2&sort=date&filter=open" },
+    { "REQUEST_METHOD", "GET" },
+    { "CONTENT_TYPE", "" },
+    { "CONTENT_LENGTH", "" },
+    { "SCRIPT_NAME", "/app/items" },
+    { "REQUEST_URI", "/app/items?page=2&sort=date&filter=open" },
+    { "DOCUMENT_URI", "/app/items" },
+    { "DOCUMENT_ROOT", "/var/www/app" },
+    { "SERVER_PROTOCOL", "HTTP/1.1" },
+    { "REQUEST_SCHEME", "https" },
+    { "HTTPS", "on" },
+    { "GATEWAY_INTERFACE", "CGI/1.1" },
+    { "SERVER_SOFTWARE", "nginx/1.24.0" },
+    { "REMOTE_ADDR", "203.0.113.57" },
+    { "REMOTE_PORT", "51724" },
+    { "SERVER_ADDR", "198.51.100.10" },
+    { "SERVER_PORT", "443" },
+    { "SERVER_NAME", "www.example.com" },
+    { "REDIRECT_STATUS", "200" },
+    { "HTTP_HOST", "www.example.com" },
+    { "HTTP_CONNECTION", "keep-alive" },
+    { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" },
+    { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36" },
+    { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,"
+        "image/avif,image/webp,*/*;q=0.8" },
+    { "HTTP_REFERER", "https://www.example.com/app/items?page=1" },
+    { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+    { "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.9" },
+    { "HTTP_COOKIE", "session=6f1c2b0e9d8a4c7f8e2b1a0d3c4e5f60; theme=dark; "
+        "consent=1; _ga=GA1.2.1234567890.1700000000" },
+};
+
+
+class MicroBench : public FastCGIServer {
+public:
+    MicroBench(unsigned long long p_duration,
+               const std::vector<std::string>& p_selected) :
+        duration(p_duration), selected(p_selected)
+    {
+        for (unsigned i = 0; i < sizeof(nginx_params) / sizeof(*nginx_params);
+                i++)
+            write_pair(params, nginx_params[i][0], nginx_params[i][1]);
+        complete_handler(&handle_complete);
+    }
+
+    void run() {
+        FastCGIParams env;
+        measure("params/parse", [&] {
+            env.parse(params.data(), params.size());
+        });
+        measure("parse_pairs", [&] {
+            parse_pairs(params.data(), params.size());
+        });
+
+        std::vector<std::pair<std::string, std::string> > pairs;
+        for (unsigned i = 0; i < sizeof(nginx_params) / sizeof(*nginx_params);
+                i++)
+            pairs.push_back(std::make_pair(std::string(nginx_params[i][0]),
+                std::string(nginx_params[i][1])));
+        std::string encoded;
+        measure("write_pair", [&] {
+            encoded.clear();
+            for (std::vector<std::pair<std::string, std::string> >::
+                    const_iterator it = pairs.begin(); it != pairs.end(); ++it)
+                write_pair(encoded, it->first, it->second);
+        });
+
+        write_data_case("write_data/200", 200);
+        write_data_case("write_data/64k", 65536);
+        write_data_case("write_data/1m", 1 << 20);
+
+        params_map(false);
+        read_case("read/get", 0);
+        read_case("read/post-4k", 4096);
+        read_case("read/post-256k", 262144);
+        params_map(true);
+        read_case("read/get-map", 0);
+    }
+
+private:
+    static std::string response;
+
+    static int handle_complete(FastCGIRequest& request) {
+        request.out.append(response);
+        return 0;
+    }
+
+    // calls op until the time is up and reports the average
+    template<class Op>
+    void measure(const char* name, Op op) {
+        bool wanted = selected.empty();
+        for (std::vector<std::string>::const_iterator it = selected.begin();
+                it != selected.end(); ++it)
+            if (std::string(name).compare(0, it->size(), *it) == 0)
+                wanted = true;
+        if (!wanted)
+            return;
+
+        // warm up the caches and the pools
+        for (int i = 0; i < 100; i++)
+            op();
+
+        unsigned long long calls = 0, allocated = allocations, elapsed;
+        unsigned long long start = now();
+        do {
+            for (int i = 0; i < 100; i++)
+                op();
+            calls += 100;
+            elapsed = now() - start;
+        } while (elapsed < duration);
+
+        printf("%-20s %12.1f ns %10.2f allocations\n", name,
+            static_cast<double>(elapsed) / calls,
+            static_cast<double>(allocations - allocated) / calls);
+    }
+
+    void write_data_case(const char* name, std::string::size_type n) {
+        std::string body(n, 'x');
+        std::string payload;
+        OutputQueue queue;
+        measure(name, [&] {
+            payload.append(body);
+            write_data(queue, 1, payload, FCGI_STDOUT);
+            drain(queue);
+        });
+    }
+
+    void read_case(const char* name, std::string::size_type body) {
+        response = "Content-Type: text/html; charset=utf-8\r\n\r\n";
+        response.append(200, 'x');
+
+        std::string stream(request_stream(body));
+        Connection connection;
+        measure(name, [&] {
+            std::string::size_type available;
+            char* buffer = connection.input_buffer.prepare(stream.size(),
+                available);
+            memcpy(buffer, stream.data(), stream.size());
+            connection.input_buffer.commit(stream.size());
+            process_connection_read(connection);
+            process_connection_write(connection);
+            drain(connection);
+            if (connection.requests.size() != 0 ||
+                    !connection.input_buffer.empty())
+                throw std::runtime_error("request didn't finish");
+        });
+    }
+
+    // one request with ID 1 on a kept connection;  nginx sends all the
+    // parameters in one record and the body in records of up to 32 KiB
+    std::string request_stream(std::string::size_type body) const {
+        std::string stream;
+        FCGI_BeginRequestBody begin;
+        bzero(&begin, sizeof(begin));
+        begin.roleB0 = FCGI_RESPONDER;
+        begin.flags = FCGI_KEEP_CONN;
+        record(stream, FCGI_BEGIN_REQUEST,
+            reinterpret_cast<const char*>(&begin), sizeof(begin));
+        record(stream, FCGI_PARAMS, params.data(), params.size());
+        record(stream, FCGI_PARAMS, 0, 0);
+        std::string in(body, 'x');
+        for (std::string::size_type i = 0; i < in.size(); i += 32768)
+            record(stream, FCGI_STDIN, in.data() + i,
+                std::min(in.size() - i, (std::string::size_type)32768));
+        record(stream, FCGI_STDIN, 0, 0);
+        return stream;
+    }
+
+    static void record(std::string& stream, unsigned char type,
+                       const char* data, std::string::size_type n) {
+        FCGI_Header header;
+        bzero(&header, sizeof(header));
+        header.version = FCGI_VERSION_1;
+        header.type = type;
+        header.requestIdB0 = 1;
+        header.contentLengthB1 = n >> 8;
+        header.contentLengthB0 = n & 0xff;
+        header.paddingLength = (8 - n % 8) % 8;
+        stream.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.append(data, n);
+        stream.append(header.paddingLength, '\0');
+    }
+
+    // as if the socket took everything
+    static void drain(OutputQueue& queue) {
+        while (!queue.empty()) {
+            struct iovec iov[64];
+            int count = queue.gather(iov, 64, true);
+            std::string::size_type offered = 0;
+            for (int i = 0; i < count; i++)
+                offered += iov[i].iov_len;
+            queue.consume(offered);
+        }
+    }
+
+    // the same, counting the response as sent
+    static void drain(Connection& connection) {
+        while (!connection.output_buffer.empty()) {
+            struct iovec iov[64];
+            int count = connection.output_buffer.gather(iov, 64, true);
+            std::string::size_type offered = 0;
+            for (int i = 0; i < count; i++)
+                offered += iov[i].iov_len;
+            sent(connection, offered, offered);
+        }
+    }
+
+    unsigned long long duration;
+    std::vector<std::string> selected;
+    std::string params;
+};
+
+
+std::string MicroBench::response;
+
+
+int
+main(int argc, char** argv)
+{
+    double seconds = 0.5;
+    int option;
+    while ((option = getopt(argc, argv, "d:")) != -1)
+        switch (option) {
+        case 'd': seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "usage: fcgimicro [-d seconds] [case...]\n");
+            return 2;
+        }
+
+    try {
+        MicroBench bench(seconds * 1e9,
+            std::vector<std::string>(argv + optind, argv + argc));
+        bench.run();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
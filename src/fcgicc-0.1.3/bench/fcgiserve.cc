@@ -0,0 +1,219 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ */
+
+/*
+
+$ ./fcgiserve [options] port
+$ ./fcgiserve [options] /path/to/socket
+
+A FastCGI application for fcgibench to measure the server with.  It
+discards the standard input and answers every request with the same body.
+
+    -e NAME   event loop:  epoll, select, group, asio or uring (epoll, or
+              select where there is no epoll)
+    -w N      workers for group and threads for asio, 0 is one per CPU (0)
+    -s N      bytes of response body (64)
+    -p N      run the complete handler on a pool of N threads (off)
+    -l N      microseconds of work for the handler to do per request (0)
+    -o N      shed load once requests wait over N ms, see
+              FastCGIServer::overload_target() (off)
+
+Requests for /metrics are answered with the server's stats.  On SIGINT or
+SIGTERM it prints the requests it has answered and the processor time that
+took, and for uring the system calls made, so that loops can be compared by
+cost as well as by throughput.
+
+*/
+
+
+#include <fcgicc.h>
+#ifdef FCGISERVE_ASIO
+#include <fcgicc_asio.h>
+#endif
+#ifdef FCGISERVE_URING
+#include <fcgicc_uring.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+
+static std::string response;
+static unsigned work; // us
+#ifdef FCGISERVE_URING
+static IoUringFastCGIServer* uring_server;
+#endif
+
+
+static unsigned long long
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int
+handle_data(FastCGIRequest& request)
+{
+    request.in.clear();
+    return 0;
+}
+
+
+static int
+handle_complete(FastCGIRequest& request)
+{
+    request.in.clear();
+    if (work) {
+        // busy, as a handler that computes its answer would be
+        unsigned long long until = now() + work * 1000ULL;
+        while (now() < until)
+            ;
+    }
+    request.out.append(response);
+    return 0;
+}
+
+
+template<class Server>
+static void
+configure(Server& server, const std::string& address,
+          FastCGIHandlerPool* pool, unsigned overload_ms)
+{
+    server.data_handler(&handle_data);
+    server.complete_handler(&handle_complete);
+    server.params_map(false);
+    server.stats_route("/metrics");
+    if (pool)
+        server.handler_pool(pool);
+    if (overload_ms)
+        server.overload_target(overload_ms);
+    if (address.find('/') != std::string::npos)
+        server.listen(address);
+    else
+        server.listen(atoi(address.c_str()));
+}
+
+
+// waits for the signal to stop on a thread of its own, where it's safe to
+// look at the stats
+static void
+report_on_signal(sigset_t signals)
+{
+    int signal;
+    sigwait(&signals, &signal);
+
+    FastCGIServer::Stats stats = FastCGIServer::stats();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    unsigned long long requests = stats.requests_finished;
+    fprintf(stderr, "%llu requests, %.2f s of processor time, %.2f us each\n",
+        requests, cpu, requests ? cpu * 1e6 / requests : 0.0);
+#ifdef FCGISERVE_URING
+    if (uring_server)
+        fprintf(stderr, "%llu system calls, %.3f per request\n",
+            uring_server->system_calls(),
+            requests ? double(uring_server->system_calls()) / requests : 0.0);
+#endif
+    _exit(0);
+}
+
+
+static void
+usage()
+{
+    fprintf(stderr, "usage: fcgiserve [-e epoll|select|group|asio|uring] "
+        "[-w workers] [-s body_bytes]\n"
+        "                 [-p pool_threads] [-l work_us] [-o target_ms] "
+        "port | path\n");
+    exit(2);
+}
+
+
+int
+main(int argc, char** argv)
+{
+#ifdef __linux__
+    std::string loop("epoll");
+#else
+    std::string loop("select");
+#endif
+    unsigned workers = 0, body = 64, overload_ms = 0;
+    int pool_threads = -1;
+    int option;
+    while ((option = getopt(argc, argv, "e:w:s:p:l:o:")) != -1)
+        switch (option) {
+        case 'e': loop = optarg; break;
+        case 'w': workers = atoi(optarg); break;
+        case 's': body = atoi(optarg); break;
+        case 'p': pool_threads = atoi(optarg); break;
+        case 'l': work = atoi(optarg); break;
+        case 'o': overload_ms = atoi(optarg); break;
+        default: usage();
+        }
+    if (optind + 1 != argc)
+        usage();
+    std::string address(argv[optind]);
+
+    response = "Content-Type: text/plain\r\n\r\n";
+    response.append(body, 'x');
+
+    // before any other thread is started, so that they all block them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, 0);
+    std::thread(report_on_signal, signals).detach();
+
+    std::unique_ptr<FastCGIHandlerPool> pool;
+    if (pool_threads >= 0)
+        pool.reset(new FastCGIHandlerPool(pool_threads));
+
+    try {
+        if (loop == "epoll" || loop == "select") {
+            FastCGIServer server;
+            if (loop == "select")
+                server.set_poller(new FastCGISelectPoller);
+            configure(server, address, pool.get(), overload_ms);
+            server.process_forever();
+        } else if (loop == "group") {
+            FastCGIServerGroup server(workers);
+            configure(server, address, pool.get(), overload_ms);
+            server.process_forever();
+#ifdef FCGISERVE_ASIO
+        } else if (loop == "asio") {
+            AsioFastCGIServer server(workers);
+            configure(server, address, pool.get(), overload_ms);
+            server.run();
+#endif
+#ifdef FCGISERVE_URING
+        } else if (loop == "uring") {
+            IoUringFastCGIServer server;
+            uring_server = &server;
+            configure(server, address, pool.get(), overload_ms);
+            server.process_forever();
+#endif
+        } else
+            usage();
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Error: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -34,443 +34,2770 @@
 
 #include "fcgicc.h"
 
-#include <cstring> // bzero, memcpy
+#include <algorithm> // find, max, min, reverse
+#include <climits> // INT_MAX, LLONG_MAX
+#include <cstdio> // snprintf
+#include <cstring> // bzero, memcpy, memmove
+#include <exception> // exception_ptr, current_exception, rethrow_exception
+#include <mutex>
 #include <stdexcept>
+#include <thread>
 
 #include <errno.h> // E*
+#include <fcntl.h> // fcntl, F_*, O_NONBLOCK
 #include <unistd.h> // read, write, close, unlink
 #include <arpa/inet.h> // hton*
 #include <netinet/in.h> // sockaddr_in, INADDR_*
 #include <sys/select.h> // select, fd_set, FD_*, timeval
-#include <sys/socket.h> // socket, bind, accept, listen, sockaddr, AF_*, SOCK_*
+#include <sys/socket.h> // socket, bind, accept, listen, sendmsg, sockaddr, AF_*
+#include <sys/mman.h> // mmap, munmap
+#include <sys/resource.h> // getrlimit, RLIMIT_NOFILE
+#include <sys/uio.h> // iovec
 #include <sys/un.h> // sockaddr_un
+#include <time.h> // clock_gettime, CLOCK_MONOTONIC
+
+#ifdef __linux__
+#include <sys/eventfd.h> // eventfd, EFD_*
+#include <sys/sendfile.h> // sendfile
+#endif
 
 #include <fastcgi.h>
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // BSD, sockets get SO_NOSIGPIPE instead
+#endif
 
-FastCGIServer::RequestInfo::RequestInfo() :
-    params_closed(false),
-    in_closed(false),
-    output_closed(false)
+
+static void
+set_nonblocking(int fd)
 {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        throw std::runtime_error("fcntl() failed");
 }
 
 
-
-FastCGIServer::Connection::Connection() :
-    close_responsibility(false),
-    close_socket(false)
+void
+FastCGISelectPoller::add(int fd, unsigned events)
 {
+    if (fd >= FD_SETSIZE)
+        throw std::runtime_error("descriptor exceeds FD_SETSIZE");
+    registered[fd] = events;
 }
 
 
-int
-FastCGIServer::HandlerBase::operator()(FastCGIRequest&)
+void
+FastCGISelectPoller::modify(int fd, unsigned events)
 {
-    return 0;
+    registered[fd] = events;
 }
 
 
-FastCGIServer::FastCGIServer() :
-    handle_request(new HandlerBase),
-    handle_data(new HandlerBase),
-    handle_complete(new HandlerBase)
+void
+FastCGISelectPoller::remove(int fd)
 {
+    registered.erase(fd);
 }
 
 
-FastCGIServer::~FastCGIServer()
+void
+FastCGISelectPoller::wait(std::vector<Event>& ready, int timeout_ms)
 {
-    for (std::vector<int>::iterator it = listen_sockets.begin();
-            it != listen_sockets.end(); ++it)
-        close(*it);
+    fd_set fs_read;
+    fd_set fs_write;
+    int nfd = 0;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
 
-    for (std::vector<std::string>::iterator it = listen_unlink.begin();
-            it != listen_unlink.end(); ++it)
-        unlink(it->c_str());
+    ready.clear();
+    FD_ZERO(&fs_read);
+    FD_ZERO(&fs_write);
+
+    for (std::map<int, unsigned>::const_iterator it = registered.begin();
+            it != registered.end(); ++it) {
+        if (it->second & readable)
+            FD_SET(it->first, &fs_read);
+        if (it->second & writable)
+            FD_SET(it->first, &fs_write);
+        nfd = std::max(nfd, it->first);
+    }
 
-    for (std::map<int, Connection*>::iterator it = read_sockets.begin();
-            it != read_sockets.end(); ++it) {
-        close(it->first);
-        for (RequestList::iterator req_it = it->second->requests.begin();
-                req_it != it->second->requests.end(); ++req_it)
-            delete req_it->second;
-        delete it->second;
+    int select_result = select(nfd + 1, &fs_read, &fs_write, NULL,
+        timeout_ms < 0 ? NULL : &tv);
+    if (select_result == -1) {
+        if (errno == EINTR)
+            return;
+        else
+            throw std::runtime_error("select() failed");
     }
 
-    delete handle_request;
-    delete handle_data;
-    delete handle_complete;
+    for (std::map<int, unsigned>::const_iterator it = registered.begin();
+            select_result > 0 && it != registered.end(); ++it) {
+        Event event = { it->first, 0 };
+        if (FD_ISSET(it->first, &fs_read))
+            event.events |= readable;
+        if (FD_ISSET(it->first, &fs_write))
+            event.events |= writable;
+        if (event.events) {
+            ready.push_back(event);
+            --select_result;
+        }
+    }
 }
 
 
-void
-FastCGIServer::request_handler(int (* function)(FastCGIRequest&))
+#ifdef __linux__
+FastCGIEpollPoller::FastCGIEpollPoller() :
+    epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+    buffer(256)
 {
-    handle_request = new StaticHandler(function);
+    if (epoll_fd == -1)
+        throw std::runtime_error("epoll_create1() failed");
+}
+
+
+FastCGIEpollPoller::~FastCGIEpollPoller()
+{
+    close(epoll_fd);
 }
 
 
 void
-FastCGIServer::data_handler(int (* function)(FastCGIRequest&))
+FastCGIEpollPoller::add(int fd, unsigned)
 {
-    handle_data = new StaticHandler(function);
+    struct epoll_event event;
+    bzero(&event, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        throw std::runtime_error("epoll_ctl() failed");
 }
 
 
 void
-FastCGIServer::complete_handler(int (* function)(FastCGIRequest&))
+FastCGIEpollPoller::modify(int, unsigned)
 {
-    handle_complete = new StaticHandler(function);
 }
 
 
 void
-FastCGIServer::set_handler(HandlerBase*& handler, HandlerBase* new_handler)
+FastCGIEpollPoller::remove(int fd)
 {
-    delete handler;
-    handler = new_handler;
+    struct epoll_event event; // pre-2.6.9 kernels insist on a non-null event
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &event);
 }
 
 
 void
-FastCGIServer::listen(unsigned tcp_port)
+FastCGIEpollPoller::wait(std::vector<Event>& ready, int timeout_ms)
 {
-    int listen_socket = socket(PF_INET, SOCK_STREAM, 0);
-    if (listen_socket == -1)
-        throw std::runtime_error("socket() failed");
+    ready.clear();
+
+    int wait_result = epoll_wait(epoll_fd, &buffer[0], buffer.size(),
+        timeout_ms);
+    if (wait_result == -1) {
+        if (errno == EINTR)
+            return;
+        else
+            throw std::runtime_error("epoll_wait() failed");
+    }
 
-    try {
-        struct sockaddr_in sa;
-        bzero(&sa, sizeof(sa));
-        sa.sin_family = AF_INET;
-        sa.sin_port = htons(tcp_port);
-        sa.sin_addr.s_addr = htonl(INADDR_ANY);
-        if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) == -1)
-            throw std::runtime_error("bind() failed");
+    for (int i = 0; i < wait_result; i++) {
+        Event event = { buffer[i].data.fd, 0 };
+        if (buffer[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            event.events |= readable;
+        if (buffer[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            event.events |= writable;
+        ready.push_back(event);
+    }
+}
+#endif
+
+
+static const struct {
+    const char* name;
+    std::string::size_type size;
+} known_params[FastCGIParams::known_count] = {
+#define KNOWN(name) { #name, sizeof(#name) - 1 }
+    KNOWN(CONTENT_LENGTH),
+    KNOWN(CONTENT_TYPE),
+    KNOWN(DOCUMENT_ROOT),
+    KNOWN(DOCUMENT_URI),
+    KNOWN(GATEWAY_INTERFACE),
+    KNOWN(HTTPS),
+    KNOWN(HTTP_ACCEPT_ENCODING),
+    KNOWN(HTTP_COOKIE),
+    KNOWN(HTTP_HOST),
+    KNOWN(HTTP_REFERER),
+    KNOWN(HTTP_USER_AGENT),
+    KNOWN(QUERY_STRING),
+    KNOWN(REDIRECT_STATUS),
+    KNOWN(REMOTE_ADDR),
+    KNOWN(REMOTE_PORT),
+    KNOWN(REQUEST),
+    KNOWN(REQUEST_BODY),
+    KNOWN(REQUEST_METHOD),
+    KNOWN(REQUEST_SCHEME),
+    KNOWN(REQUEST_URI),
+    KNOWN(SCHEME),
+    KNOWN(SCRIPT_FILENAME),
+    KNOWN(SCRIPT_NAME),
+    KNOWN(SERVER_ADDR),
+    KNOWN(SERVER_NAME),
+    KNOWN(SERVER_PORT),
+    KNOWN(SERVER_PROTOCOL),
+    KNOWN(SERVER_SOFTWARE)
+#undef KNOWN
+};
+
+
+const char*
+FastCGIParams::name(Known name)
+{
+    return known_params[name].name;
+}
 
-        if (::listen(listen_socket, 100))
-            throw std::runtime_error("listen() failed");
 
-        listen_sockets.push_back(listen_socket);
+bool
+FastCGIParams::has(std::string_view name) const
+{
+    for (const_iterator it = pairs.begin(); it != pairs.end(); ++it)
+        if (it->first == name)
+            return true;
+    return false;
+}
 
-    } catch (...) {
-        close(listen_socket);
-        throw;
-    }
+
+std::string_view
+FastCGIParams::get(std::string_view name) const
+{
+    for (const_iterator it = pairs.begin(); it != pairs.end(); ++it)
+        if (it->first == name)
+            return it->second;
+    return std::string_view();
 }
 
 
 void
-FastCGIServer::listen(const std::string& local_path)
+FastCGIParams::clear()
 {
-    int listen_socket = socket(PF_UNIX, SOCK_STREAM, 0);
-    if (listen_socket == -1)
-        throw std::runtime_error("socket() failed");
+    pairs.clear();
+    std::fill(known, known + known_count, 0);
+}
 
-    try {
-        struct sockaddr_un sa;
-        bzero(&sa, sizeof(sa));
-        sa.sun_family = AF_LOCAL;
 
-        std::string::size_type size = local_path.size();
-        if (size >= sizeof(sa.sun_path))
-            throw std::runtime_error("path too long");
-        if (local_path.find_first_of('\0') != std::string::npos)
-            throw std::runtime_error("null character in path");
+void
+FastCGIParams::parse(const char* data, std::string::size_type n)
+{
+    clear();
 
-        std::memcpy(sa.sun_path, local_path.data(), size);
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(data);
 
-        unlink(local_path.c_str());
-        try {
-            if (bind(listen_socket, (struct sockaddr*)&sa,
-                    sizeof(sa) - (sizeof(sa.sun_path) - size - 1)) == -1)
-                throw std::runtime_error("bind() failed");
+    for (std::string::size_type m = 0; m < n;) {
+        std::string::size_type name_length, value_length;
 
-            if (::listen(listen_socket, 100))
-                throw std::runtime_error("listen() failed");
+        if (u[m] >> 7) {
+            if (n - m < 4)
+                break;
+            name_length = ((u[m] & 0x7f) << 24) + (u[m + 1] << 16) +
+                (u[m + 2] << 8) + u[m + 3];
+            m += 4;
+        } else
+            name_length = u[m++];
+        if (m >= n)
+            break;
 
-            listen_sockets.push_back(listen_socket);
-            listen_unlink.push_back(local_path);
+        if (u[m] >> 7) {
+            if (n - m < 4)
+                break;
+            value_length = ((u[m] & 0x7f) << 24) + (u[m + 1] << 16) +
+                (u[m + 2] << 8) + u[m + 3];
+            m += 4;
+        } else
+            value_length = u[m++];
 
-        } catch (...) {
-            unlink(local_path.c_str());
-            throw;
-        }
+        if (n - m < name_length)
+            break;
+        const char* name = data + m;
+        m += name_length;
 
-    } catch (...) {
-        close(listen_socket);
-        throw;
+        if (n - m < value_length)
+            break;
+        pairs.push_back(Pair(std::string_view(name, name_length),
+            std::string_view(data + m, value_length)));
+        m += value_length;
+
+        // most names are known ones, and lengths tell most of them apart
+        for (int i = 0; i < known_count; i++)
+            if (known_params[i].size == name_length &&
+                    std::memcmp(known_params[i].name, name, name_length) == 0) {
+                if (!known[i])
+                    known[i] = pairs.size();
+                break;
+            }
     }
 }
 
 
-void
-FastCGIServer::abandon_files()
+long long
+FastCGIRequest::remaining() const
 {
-    listen_unlink.clear();
+    if (!deadline)
+        return LLONG_MAX;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return deadline - (ts.tv_sec * 1000000000ULL + ts.tv_nsec);
 }
 
 
-void
-FastCGIServer::process(int timeout_ms)
-{
-    char buffer[4096];
-    fd_set fs_read;
-    fd_set fs_write;
-    int nfd = 0;
-    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+struct FastCGIDeferred::State {
+    State() :
+        status(0), request(0), completed(false), finished(false),
+        abandoned(false), posted(false), next(0) {}
 
-    FD_ZERO(&fs_read);
-    FD_ZERO(&fs_write);
+    std::string out;
+    std::string err;
+    int status;
 
-    for (std::vector<int>::const_iterator it = listen_sockets.begin();
-            it != listen_sockets.end(); ++it) {
-        FD_SET(*it, &fs_read);
-        nfd = std::max(nfd, *it);
-    }
+    // the loop thread's side, null once the request has been released
+    FastCGIRequest* request;
+    std::shared_ptr<Completer> completer;
 
-    for (std::map<int, Connection*>::const_iterator it = read_sockets.begin();
-            it != read_sockets.end(); ++it) {
-        FD_SET(it->first, &fs_read);
-        if (!it->second->output_buffer.empty())
-            FD_SET(it->first, &fs_write);
-        nfd = std::max(nfd, it->first);
-    }
+    std::atomic<bool> completed; // complete() has been called
+    std::atomic<bool> finished; // and the output and status are there
+    std::atomic<bool> abandoned;
 
-    int select_result = select(nfd + 1, &fs_read, &fs_write, NULL,
-        timeout_ms < 0 ? NULL : &tv);
-    if (select_result == -1) {
-	if (errno == EINTR) {
-	    return;
-	} else {
-	    throw std::runtime_error("select() failed");
-	}
-    }
+    // set while it is on a CompletionQueue, which then holds a reference
+    std::atomic<bool> posted;
+    State* next;
+    std::shared_ptr<State> queued;
+};
 
-    for (std::vector<int>::const_iterator it = listen_sockets.begin();
-            it != listen_sockets.end(); ++it)
-        if (FD_ISSET(*it, &fs_read)) {
-            int read_socket = accept(*it, NULL, NULL);
-            if (read_socket == -1)
-                throw std::runtime_error("accept() failed");
-            Connection* connection = new Connection;
-            try {
-                read_sockets.insert(std::map<int, Connection*>::value_type(
-                    read_socket,  connection));
-            } catch (...) {
-                delete connection;
-                throw;
-            }
-        }
 
-    for (std::map<int, Connection*>::iterator it = read_sockets.begin();
-            it != read_sockets.end();) {
-        int read_socket = it->first;
+std::string&
+FastCGIDeferred::out()
+{
+    return state->out;
+}
 
-        if (FD_ISSET(read_socket, &fs_read)) {
-            int read_result = read(read_socket, buffer, sizeof(buffer));
-	    if (read_result == -1) {
-		if (errno == ECONNRESET)
-		    goto close_socket;
-		else
-		    throw std::runtime_error("read() on socket failed");
-	    }
-	    if (read_result == 0)
-		it->second->close_socket = true;
-	    else {
-                it->second->input_buffer.append(buffer, read_result);
-                process_connection_read(*it->second);
-            }
-        }
 
-        if (!it->second->output_buffer.empty() &&
-                FD_ISSET(read_socket, &fs_write)) {
-            process_connection_write(*it->second);
-            int write_result = write(read_socket,
-                it->second->output_buffer.data(),
-                it->second->output_buffer.size());
-	    if (write_result == -1)
-		throw std::runtime_error("write() failed");
-            it->second->output_buffer.erase(0, write_result);
-        }
-
-        if (it->second->close_socket && it->second->output_buffer.empty()) {
-        close_socket:
-            int close_result = close(it->first);
-            if (close_result == -1 && errno != ECONNRESET)
-                throw std::runtime_error("close() failed");
-            Connection* connection = it->second;
-            read_sockets.erase(it++);
-            delete connection;
-	} else
-	    ++it;
-    }
+std::string&
+FastCGIDeferred::err()
+{
+    return state->err;
 }
 
 
 void
-FastCGIServer::process_forever()
+FastCGIDeferred::complete(int status)
 {
-    for (;;)
-        process();
+    if (!state || state->completed.exchange(true))
+        return;
+    state->status = status;
+    state->finished.store(true, std::memory_order_release);
+    if (!state->abandoned.load(std::memory_order_relaxed))
+        state->completer->post(state);
 }
 
 
 void
-FastCGIServer::process_connection_read(Connection& connection)
+FastCGIDeferred::wake()
 {
-    std::string::size_type n = 0;
-    while (connection.input_buffer.size() - n >= FCGI_HEADER_LEN) {
-        const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(
-            connection.input_buffer.data() + n);
-        if (header.version != FCGI_VERSION_1) {
-            connection.close_socket = true;
-            break;
-        }
+    if (state && !state->abandoned.load(std::memory_order_relaxed))
+        state->completer->post(state);
+}
 
-        unsigned content_length =
-            (header.contentLengthB1 << 8) + header.contentLengthB0;
-        if (connection.input_buffer.size() - n <
-                FCGI_HEADER_LEN + content_length + header.paddingLength)
-            break;
-        const char* content =
-            connection.input_buffer.data() + n + FCGI_HEADER_LEN;
 
-        RequestID request_id = (header.requestIdB1 << 8) + header.requestIdB0;
+bool
+FastCGIDeferred::abandoned() const
+{
+    return !state || state->abandoned.load(std::memory_order_relaxed);
+}
 
-        switch (header.type) {
-        case FCGI_GET_VALUES: {
-            Pairs pairs = parse_pairs(content, content_length);
 
-            std::string::size_type base = connection.output_buffer.size();
-            connection.output_buffer.push_back(FCGI_VERSION_1);
-            connection.output_buffer.push_back(FCGI_GET_VALUES_RESULT);
-            connection.output_buffer.append(FCGI_HEADER_LEN - 2, 0);
+void
+FastCGIWriter::flush()
+{
+    FastCGIServer::RequestInfo& info =
+        static_cast<FastCGIServer::RequestInfo&>(request);
+    if (!info.connection)
+        return; // on a pool thread, sent once the handler returns
+    if (!info.output_closed)
+        FastCGIServer::write_streams(*info.connection, info);
+}
 
-            for (Pairs::iterator it = pairs.begin(); it != pairs.end(); ++it)
-                if (it->first == FCGI_MAX_CONNS)
-                    write_pair(connection.output_buffer,
-                        it->first, std::string("100"));
-                else if (it->first == FCGI_MAX_REQS)
-                    write_pair(connection.output_buffer,
-                        it->first, std::string("1000"));
-                else if (it->first == FCGI_MPXS_CONNS)
-                    write_pair(connection.output_buffer,
-                        it->first, std::string("1"));
 
-            std::string::size_type len = connection.output_buffer.size() - base;
-            connection.output_buffer[base + 4] = (len >> 8) & 0xff;
-            connection.output_buffer[base + 5] = len & 0xff;
-            break;
-        }
-        case FCGI_BEGIN_REQUEST: {
-            if (content_length < sizeof(FCGI_BeginRequestBody))
-                break;
-            const FCGI_BeginRequestBody& body =
-                *reinterpret_cast<const FCGI_BeginRequestBody*>(content);
+void
+FastCGIWriter::send_file(int file_descriptor, off_t offset,
+                         std::string::size_type length)
+{
+    FastCGIServer::RequestInfo& info =
+        static_cast<FastCGIServer::RequestInfo&>(request);
+    if (!info.connection) {
+        close(file_descriptor);
+        throw std::runtime_error("send_file() on a pool thread");
+    }
+    if (info.output_closed || length == 0) {
+        close(file_descriptor);
+        return;
+    }
 
-            if (!(body.flags & FCGI_KEEP_CONN))
-                connection.close_responsibility = true;
+    // what was written before goes first
+    FastCGIServer::write_streams(*info.connection, info);
+    FastCGIServer::write_file(info.connection->output_buffer, info.id,
+        file_descriptor, offset, length);
+    info.output_started = true;
+    info.connection->schedule(&info);
+}
 
-            unsigned role = (body.roleB1 << 8) + body.roleB0;
-            if (role != FCGI_RESPONDER) {
-                FCGI_EndRequestRecord unknown;
-                bzero(&unknown, sizeof(unknown));
-                unknown.header.version = FCGI_VERSION_1;
-                unknown.header.type = FCGI_END_REQUEST;
-                unknown.header.contentLengthB0 = sizeof(unknown.body);
-                unknown.body.protocolStatus = FCGI_UNKNOWN_ROLE;
-                connection.output_buffer.append(
-                    reinterpret_cast<const char*>(&unknown), sizeof(unknown));
-                if (connection.close_responsibility)
-                    connection.close_socket = true;
-                break;
-            }
 
-            {
-                RequestList::iterator it = connection.requests.find(request_id);
-                if (it != connection.requests.end()) {
-                    delete it->second;
-                    connection.requests.erase(it);
-                }
-            }
+bool
+FastCGIWriter::full() const
+{
+    const FastCGIServer::RequestInfo& info =
+        static_cast<const FastCGIServer::RequestInfo&>(request);
+    if (!info.connection)
+        return false;
+    return info.connection->output_buffer.size() + request.out.size() >
+        info.connection->output_watermark;
+}
 
-            RequestInfo* new_request = new RequestInfo;
-            try {
-                connection.requests.insert(RequestList::value_type(
-                    request_id, new_request));
-            } catch (...) {
-                delete new_request;
-                throw;
-            }
-            break;
-        }
-        case FCGI_ABORT_REQUEST: {
-            RequestList::iterator it = connection.requests.find(request_id);
-            if (it == connection.requests.end())
-                break;
 
-            FCGI_EndRequestRecord aborted;
-            bzero(&aborted, sizeof(aborted));
-            aborted.header.version = FCGI_VERSION_1;
-            aborted.header.type = FCGI_END_REQUEST;
-            aborted.header.contentLengthB0 = sizeof(aborted.body);
-            aborted.body.appStatusB0 = 1;
-            aborted.body.protocolStatus = FCGI_REQUEST_COMPLETE;
-            connection.output_buffer.append(
-                reinterpret_cast<const char*>(&aborted), sizeof(aborted));
-            if (connection.close_responsibility)
-                connection.close_socket = true;
+bool
+FastCGIWriter::wait_drained()
+{
+    FastCGIServer::RequestInfo& info =
+        static_cast<FastCGIServer::RequestInfo&>(request);
+    if (!info.connection)
+        return false;
+    FastCGIServer::Connection& connection = *info.connection;
+    if (connection.output_buffer.size() <= connection.output_watermark / 2)
+        return false;
+    if (!info.drain_waiting) {
+        connection.drain_waiters.push_back(&info);
+        info.drain_waiting = true;
+    }
+    return true;
+}
 
-            delete it->second;
-            connection.requests.erase(it);
-            break;
-        }
-        case FCGI_PARAMS: {
-            RequestList::iterator it = connection.requests.find(request_id);
-            if (it == connection.requests.end())
+
+FastCGIHandlerPool::FastCGIHandlerPool(unsigned threads,
+                                       unsigned max_queued) :
+    limit(max_queued),
+    queued(0),
+    next(0),
+    rejected(0),
+    sleeping(0),
+    stopping(false)
+{
+    if (threads == 0)
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (unsigned i = 0; i < threads; i++)
+        workers.push_back(new Worker);
+    try {
+        for (unsigned i = 0; i < threads; i++)
+            workers[i]->thread = std::thread(&FastCGIHandlerPool::run,
+                this, i);
+    } catch (...) {
+        stop();
+        throw;
+    }
+}
+
+
+FastCGIHandlerPool::~FastCGIHandlerPool()
+{
+    stop();
+}
+
+
+void
+FastCGIHandlerPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+
+    for (std::vector<Worker*>::iterator it = workers.begin();
+            it != workers.end(); ++it) {
+        if ((*it)->thread.joinable())
+            (*it)->thread.join();
+        for (std::deque<Task*>::iterator task = (*it)->tasks.begin();
+                task != (*it)->tasks.end(); ++task)
+            delete *task;
+        delete *it;
+    }
+    workers.clear();
+}
+
+
+bool
+FastCGIHandlerPool::submit(Task* task)
+{
+    // counted before a thread can take it, so that queued never goes below
+    // zero;  either a thread going to sleep sees this, or we see it sleeping
+    unsigned waiting = queued.fetch_add(1);
+    if (limit != 0 && waiting >= limit) {
+        queued.fetch_sub(1);
+        rejected.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Worker& worker =
+        *workers[next.fetch_add(1, std::memory_order_relaxed) %
+            workers.size()];
+    try {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks.push_back(task);
+    } catch (...) {
+        queued.fetch_sub(1);
+        throw;
+    }
+
+    if (sleeping.load() != 0) {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        wakeup.notify_one();
+    }
+    return true;
+}
+
+
+FastCGIHandlerPool::Task*
+FastCGIHandlerPool::take(unsigned index)
+{
+    Worker& own = *workers[index];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            Task* task = own.tasks.front();
+            own.tasks.pop_front();
+            return task;
+        }
+    }
+
+    for (unsigned i = 1; i < workers.size(); i++) {
+        Worker& victim = *workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            // the newest, its owner gets to the old ones soonest
+            Task* task = victim.tasks.back();
+            victim.tasks.pop_back();
+            own.stolen.fetch_add(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return 0;
+}
+
+
+void
+FastCGIHandlerPool::run(unsigned index)
+{
+    Worker& worker = *workers[index];
+    for (;;) {
+        if (Task* task = take(index)) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            std::unique_ptr<Task> owned(task);
+            owned->run();
+            worker.executed.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        sleeping.fetch_add(1);
+        while (!stopping && queued.load() == 0)
+            wakeup.wait(lock);
+        sleeping.fetch_sub(1);
+        if (stopping)
+            return;
+    }
+}
+
+
+FastCGIHandlerPool::Stats
+FastCGIHandlerPool::stats() const
+{
+    Stats stats;
+    stats.threads = workers.size();
+    stats.queued = queued.load(std::memory_order_relaxed);
+    stats.executed = 0;
+    stats.stolen = 0;
+    for (std::vector<Worker*>::const_iterator it = workers.begin();
+            it != workers.end(); ++it) {
+        stats.executed += (*it)->executed.load(std::memory_order_relaxed);
+        stats.stolen += (*it)->stolen.load(std::memory_order_relaxed);
+    }
+    stats.rejected = rejected.load(std::memory_order_relaxed);
+    return stats;
+}
+
+
+char*
+FastCGIServer::InputBuffer::prepare(std::string::size_type n,
+                                    std::string::size_type& available)
+{
+    if (storage.size() - end < n && begin != 0) {
+        std::memmove(storage.data(), storage.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    if (storage.size() - end < n)
+        storage.resize(std::max(end + n, storage.size() * 2));
+
+    available = storage.size() - end;
+    return storage.data() + end;
+}
+
+
+void
+FastCGIServer::OutputQueue::append(const char* data,
+                                   std::string::size_type n)
+{
+    if (n == 0)
+        return;
+
+    if (!open) {
+        buffers.push_back(Buffer());
+        if (!spare.empty()) {
+            buffers.back().data.swap(spare.back());
+            spare.pop_back();
+        }
+        open = true;
+    }
+
+    Buffer& buffer = buffers.back();
+    if (!pieces.empty() && pieces.back().buffer == &buffer &&
+            pieces.back().end == buffer.data.size())
+        pieces.back().end += n;
+    else {
+        Piece piece = { &buffer, buffer.data.size(), buffer.data.size() + n };
+        pieces.push_back(piece);
+        ++buffer.pieces;
+    }
+    buffer.data.append(data, n);
+    total += n;
+}
+
+
+FastCGIServer::OutputQueue::Buffer*
+FastCGIServer::OutputQueue::adopt(std::string& payload)
+{
+    buffers.push_back(Buffer());
+    buffers.back().data.swap(payload);
+    if (!spare.empty()) {
+        payload.swap(spare.back());
+        spare.pop_back();
+    }
+    open = false;
+    return &buffers.back();
+}
+
+
+FastCGIServer::OutputQueue::Buffer*
+FastCGIServer::OutputQueue::adopt_file(int file,
+                                       std::string::size_type begin,
+                                       std::string::size_type end)
+{
+    static const std::string::size_type page = sysconf(_SC_PAGESIZE);
+
+    buffers.push_back(Buffer());
+    Buffer& buffer = buffers.back();
+    buffer.file = file;
+    buffer.map_begin = begin - begin % page;
+    buffer.map_end = end;
+    open = false;
+    return &buffer;
+}
+
+
+FastCGIServer::OutputQueue::~OutputQueue()
+{
+    for (std::deque<Buffer>::iterator it = buffers.begin();
+            it != buffers.end(); ++it)
+        release_file(*it);
+}
+
+
+void
+FastCGIServer::OutputQueue::release_file(Buffer& buffer)
+{
+    if (buffer.file == -1)
+        return;
+    if (buffer.map)
+        munmap(buffer.map, buffer.map_end - buffer.map_begin);
+    close(buffer.file);
+    buffer.file = -1;
+    buffer.map = 0;
+}
+
+
+void
+FastCGIServer::OutputQueue::append(Buffer* buffer,
+                                   std::string::size_type begin,
+                                   std::string::size_type n)
+{
+    if (n == 0)
+        return;
+    Piece piece = { buffer, begin, begin + n };
+    pieces.push_back(piece);
+    ++buffer->pieces;
+    total += n;
+}
+
+
+int
+FastCGIServer::OutputQueue::gather(struct iovec* iov, int max,
+                                   bool map_files)
+{
+    int count = 0;
+    for (std::deque<Piece>::const_iterator it = pieces.begin();
+            it != pieces.end() && count < max; ++it, ++count) {
+        Buffer& buffer = *it->buffer;
+        if (buffer.file == -1)
+            iov[count].iov_base = const_cast<char*>(
+                buffer.data.data() + it->begin);
+        else if (!map_files)
+            break;
+        else {
+            if (!buffer.map) {
+                void* map = mmap(0, buffer.map_end - buffer.map_begin,
+                    PROT_READ, MAP_SHARED, buffer.file, buffer.map_begin);
+                if (map == MAP_FAILED)
+                    throw std::runtime_error("mmap() failed");
+                buffer.map = map;
+            }
+            iov[count].iov_base = static_cast<char*>(buffer.map) +
+                (it->begin - buffer.map_begin);
+        }
+        iov[count].iov_len = it->end - it->begin;
+    }
+    open = false; // appending could move what we just described
+    return count;
+}
+
+
+bool
+FastCGIServer::OutputQueue::front_file(int& file, off_t& offset,
+                                       std::string::size_type& n) const
+{
+    if (pieces.empty() || pieces.front().buffer->file == -1)
+        return false;
+    file = pieces.front().buffer->file;
+    offset = pieces.front().begin;
+    n = pieces.front().end - pieces.front().begin;
+    return true;
+}
+
+
+void
+FastCGIServer::OutputQueue::consume(std::string::size_type n)
+{
+    total -= n;
+    sent += n;
+    while (n != 0) {
+        Piece& piece = pieces.front();
+        if (n < piece.end - piece.begin) {
+            piece.begin += n;
+            break;
+        }
+        n -= piece.end - piece.begin;
+        --piece.buffer->pieces;
+        pieces.pop_front();
+    }
+    release_buffers();
+}
+
+
+void
+FastCGIServer::OutputQueue::release_buffers()
+{
+    // payloads finish out of order with the inline buffers around them, so
+    // a buffer only goes once everything before it has gone too
+    while (!buffers.empty() && buffers.front().pieces == 0) {
+        if (buffers.size() == 1)
+            open = false;
+        release_file(buffers.front());
+        std::string& data = buffers.front().data;
+        if (spare.size() < 4 && data.capacity() <= 0x100000) {
+            data.clear();
+            spare.push_back(std::string());
+            spare.back().swap(data);
+        }
+        buffers.pop_front();
+    }
+}
+
+
+FastCGIServer::RequestInfo::RequestInfo() :
+    connection(0),
+    id(0),
+    params_closed(false),
+    status(0),
+    output_closed(false),
+    output_started(false),
+    drain_waiting(false),
+    begin_time(0),
+    params_time(0),
+    complete_time(0),
+    completed(false),
+    ready(false),
+    ready_prev(0),
+    ready_next(0),
+    request_timer(Timer::request_deadline, 0, this),
+    handler_timer(Timer::handler_deadline, 0, this)
+{
+}
+
+
+static void
+shrink(std::string& buffer)
+{
+    // a pooled object shouldn't pin the memory of one huge request
+    if (buffer.capacity() > 0x100000)
+        std::string().swap(buffer);
+    else
+        buffer.clear();
+}
+
+
+void
+FastCGIServer::RequestInfo::reset()
+{
+    continuation.reset();
+    params.clear();
+    env.clear();
+    shrink(in);
+    shrink(out);
+    shrink(err);
+    shrink(params_buffer);
+    params_closed = false;
+    in_closed = false;
+    status = 0;
+    deadline = 0;
+    output_closed = false;
+    output_started = false;
+    if (deferred) {
+        // a handle still refers to it, tell it not to bother
+        deferred->request = 0;
+        deferred->abandoned = true;
+        deferred.reset();
+        --connection->deferred_requests;
+    }
+    completed = false;
+    begin_time = params_time = complete_time = 0;
+    if (connection && connection->blocked == this)
+        connection->blocked = 0;
+    if (drain_waiting) {
+        std::vector<RequestInfo*>& waiters = connection->drain_waiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), this));
+        drain_waiting = false;
+    }
+    connection = 0;
+    ready = false;
+    ready_prev = ready_next = 0;
+    request_timer.cancel();
+    handler_timer.cancel();
+}
+
+
+static void
+bump(std::atomic<unsigned long long>& counter, long long n = 1)
+{
+    // single writer, so no need for a locked read-modify-write
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+        std::memory_order_relaxed);
+}
+
+
+std::mutex&
+FastCGIServer::RequestPool::registry_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+
+std::vector<FastCGIServer::RequestPool*>&
+FastCGIServer::RequestPool::registry()
+{
+    static std::vector<RequestPool*> pools;
+    return pools;
+}
+
+
+FastCGIServer::PoolStats&
+FastCGIServer::RequestPool::retired()
+{
+    static PoolStats stats = { 0, 0, 0 };
+    return stats;
+}
+
+
+FastCGIServer::RequestPool::RequestPool() :
+    hits(0),
+    misses(0),
+    cached(0)
+{
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().push_back(this);
+}
+
+
+FastCGIServer::RequestPool::~RequestPool()
+{
+    for (std::vector<RequestInfo*>::iterator it = free.begin();
+            it != free.end(); ++it)
+        delete *it;
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    std::vector<RequestPool*>& pools = registry();
+    pools.erase(std::find(pools.begin(), pools.end(), this));
+    retired().hits += hits;
+    retired().misses += misses;
+}
+
+
+FastCGIServer::RequestPool&
+FastCGIServer::RequestPool::local()
+{
+    static thread_local RequestPool pool;
+    return pool;
+}
+
+
+FastCGIServer::RequestInfo*
+FastCGIServer::RequestPool::acquire()
+{
+    if (free.empty()) {
+        RequestInfo* request = new RequestInfo;
+        bump(misses);
+        bump(ThreadStats::local().requests_started);
+        return request;
+    }
+
+    RequestInfo* request = free.back();
+    free.pop_back();
+    bump(hits);
+    bump(cached, -1);
+    bump(ThreadStats::local().requests_started);
+    return request;
+}
+
+
+void
+FastCGIServer::RequestPool::release(RequestInfo* request)
+{
+    bump(ThreadStats::local().requests_finished);
+    // detaches it from its handle and connection even if it isn't kept
+    request->reset();
+    if (free.size() >= 1024) {
+        delete request;
+        return;
+    }
+
+    try {
+        free.push_back(request);
+    } catch (...) {
+        delete request;
+        return;
+    }
+    bump(cached);
+}
+
+
+void
+FastCGIHistogram::clear()
+{
+    for (unsigned i = 0; i < buckets; i++)
+        counts[i] = 0;
+    sum = 0;
+}
+
+
+void
+FastCGIHistogram::merge(const FastCGIHistogram& other)
+{
+    for (unsigned i = 0; i < buckets; i++)
+        counts[i] += other.counts[i];
+    sum += other.sum;
+}
+
+
+unsigned long long
+FastCGIHistogram::count() const
+{
+    unsigned long long total = 0;
+    for (unsigned i = 0; i < buckets; i++)
+        total += counts[i];
+    return total;
+}
+
+
+unsigned long long
+FastCGIHistogram::percentile(double percent) const
+{
+    unsigned long long total = count();
+    if (total == 0)
+        return 0;
+
+    unsigned long long rank = total * percent / 100;
+    if (rank >= total)
+        rank = total - 1;
+    for (unsigned i = 0; i < buckets; i++) {
+        if (rank < counts[i])
+            return i + 1 < buckets ? lowest(i + 1) - 1 : ~0ULL;
+        rank -= counts[i];
+    }
+    return ~0ULL;
+}
+
+
+unsigned long long
+FastCGIHistogram::lowest(unsigned bucket)
+{
+    if (bucket < 16)
+        return bucket;
+    unsigned exponent = bucket / 16 + 3;
+    return (16ULL + bucket % 16) << (exponent - 4);
+}
+
+
+unsigned long long
+FastCGIServer::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+std::mutex&
+FastCGIServer::ThreadStats::registry_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+
+std::vector<FastCGIServer::ThreadStats*>&
+FastCGIServer::ThreadStats::registry()
+{
+    static std::vector<ThreadStats*> threads;
+    return threads;
+}
+
+
+FastCGIServer::Stats&
+FastCGIServer::ThreadStats::retired()
+{
+    static Stats stats = Stats();
+    return stats;
+}
+
+
+FastCGIServer::ThreadStats::ThreadStats() :
+    records(0),
+    bytes_received(0),
+    bytes_sent(0),
+    partial_writes(0),
+    aborts(0),
+    timeouts(0),
+    expired(0),
+    shed(0),
+    connections_refused(0),
+    requests_refused(0),
+    connections_opened(0),
+    connections_closed(0),
+    requests_started(0),
+    requests_finished(0)
+{
+    for (unsigned stage = 0; stage < Stats::stage_count; stage++) {
+        for (unsigned i = 0; i < FastCGIHistogram::buckets; i++)
+            latency[stage][i].store(0, std::memory_order_relaxed);
+        latency_sum[stage].store(0, std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().push_back(this);
+}
+
+
+FastCGIServer::ThreadStats::~ThreadStats()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    std::vector<ThreadStats*>& threads = registry();
+    threads.erase(std::find(threads.begin(), threads.end(), this));
+    add_to(retired());
+}
+
+
+FastCGIServer::ThreadStats&
+FastCGIServer::ThreadStats::local()
+{
+    static thread_local ThreadStats stats;
+    return stats;
+}
+
+
+void
+FastCGIServer::ThreadStats::record(Stats::Stage stage,
+                                   unsigned long long duration)
+{
+    bump(latency[stage][FastCGIHistogram::bucket(duration)]);
+    bump(latency_sum[stage], duration);
+}
+
+
+void
+FastCGIServer::ThreadStats::add_to(Stats& stats) const
+{
+    for (unsigned stage = 0; stage < Stats::stage_count; stage++) {
+        FastCGIHistogram& histogram = stats.latency[stage];
+        for (unsigned i = 0; i < FastCGIHistogram::buckets; i++)
+            histogram.counts[i] +=
+                latency[stage][i].load(std::memory_order_relaxed);
+        histogram.sum += latency_sum[stage].load(std::memory_order_relaxed);
+    }
+    stats.records += records.load(std::memory_order_relaxed);
+    stats.bytes_received += bytes_received.load(std::memory_order_relaxed);
+    stats.bytes_sent += bytes_sent.load(std::memory_order_relaxed);
+    stats.partial_writes += partial_writes.load(std::memory_order_relaxed);
+    stats.aborts += aborts.load(std::memory_order_relaxed);
+    stats.timeouts += timeouts.load(std::memory_order_relaxed);
+    stats.expired += expired.load(std::memory_order_relaxed);
+    stats.shed += shed.load(std::memory_order_relaxed);
+    stats.connections_refused +=
+        connections_refused.load(std::memory_order_relaxed);
+    stats.requests_refused += requests_refused.load(std::memory_order_relaxed);
+    stats.connections_opened +=
+        connections_opened.load(std::memory_order_relaxed);
+    stats.connections_closed +=
+        connections_closed.load(std::memory_order_relaxed);
+    stats.requests_started += requests_started.load(std::memory_order_relaxed);
+    stats.requests_finished +=
+        requests_finished.load(std::memory_order_relaxed);
+}
+
+
+FastCGIServer::Stats
+FastCGIServer::stats()
+{
+    std::lock_guard<std::mutex> lock(ThreadStats::registry_mutex());
+    Stats stats = ThreadStats::retired();
+    for (std::vector<ThreadStats*>::const_iterator it =
+            ThreadStats::registry().begin();
+            it != ThreadStats::registry().end(); ++it)
+        (*it)->add_to(stats);
+    return stats;
+}
+
+
+FastCGIServer::PoolStats
+FastCGIServer::pool_stats()
+{
+    std::lock_guard<std::mutex> lock(RequestPool::registry_mutex());
+    PoolStats stats = RequestPool::retired();
+    for (std::vector<RequestPool*>::const_iterator it =
+            RequestPool::registry().begin();
+            it != RequestPool::registry().end(); ++it) {
+        stats.hits += (*it)->hits.load(std::memory_order_relaxed);
+        stats.misses += (*it)->misses.load(std::memory_order_relaxed);
+        stats.cached += (*it)->cached.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+
+
+FastCGIServer::RequestTable::RequestTable() :
+    high(0),
+    count(0),
+    total(0)
+{
+    std::fill(low, low + 0x100, (RequestInfo*)0);
+}
+
+
+FastCGIServer::RequestTable::~RequestTable()
+{
+    release_all();
+    if (high) {
+        for (int i = 0; i < 0x100; i++)
+            delete[] high[i];
+        delete[] high;
+    }
+}
+
+
+void
+FastCGIServer::RequestTable::insert(RequestInfo* request)
+{
+    RequestID id = request->id;
+    if (id < 0x100)
+        low[id] = request;
+    else {
+        if (!high) {
+            high = new RequestInfo**[0x100];
+            std::fill(high, high + 0x100, (RequestInfo**)0);
+        }
+        RequestInfo**& page = high[id >> 8];
+        if (!page) {
+            page = new RequestInfo*[0x100];
+            std::fill(page, page + 0x100, (RequestInfo*)0);
+        }
+        page[id & 0xff] = request;
+    }
+    ++count;
+    if (total)
+        total->fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void
+FastCGIServer::RequestTable::erase(RequestID id)
+{
+    RequestInfo*& slot = id < 0x100 ? low[id] : high[id >> 8][id & 0xff];
+    if (slot) {
+        slot = 0;
+        --count;
+        if (total)
+            total->fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+
+void
+FastCGIServer::RequestTable::release_all()
+{
+    if (total && count != 0)
+        total->fetch_sub(count, std::memory_order_relaxed);
+
+    for (int i = 0; i < 0x100 && count != 0; i++)
+        if (low[i]) {
+            RequestPool::local().release(low[i]);
+            low[i] = 0;
+            --count;
+        }
+
+    for (int i = 0; high && i < 0x100 && count != 0; i++)
+        for (int j = 0; high[i] && j < 0x100; j++)
+            if (high[i][j]) {
+                RequestPool::local().release(high[i][j]);
+                high[i][j] = 0;
+                --count;
+            }
+}
+
+
+FastCGIServer::Connection::Connection() :
+    read_socket(-1),
+    ready_first(0),
+    ready_last(0),
+    close_responsibility(false),
+    close_socket(false),
+    reset(false),
+    events(FastCGIPoller::readable),
+    paused(false),
+    blocked(0),
+    output_watermark(0),
+    deferred_requests(0),
+    load(0),
+    idle_timer(Timer::idle_deadline, this, 0),
+    read_timer(Timer::read_deadline, this, 0),
+    accept_time(now())
+{
+    bump(ThreadStats::local().connections_opened);
+}
+
+
+FastCGIServer::Connection::~Connection()
+{
+    requests.release_all();
+    if (load)
+        load->connections.fetch_sub(1, std::memory_order_relaxed);
+    bump(ThreadStats::local().connections_closed);
+}
+
+
+void
+FastCGIServer::Connection::schedule(RequestInfo* request)
+{
+    if (request->ready)
+        return;
+    request->ready = true;
+    request->ready_prev = ready_last;
+    request->ready_next = 0;
+    if (ready_last)
+        ready_last->ready_next = request;
+    else
+        ready_first = request;
+    ready_last = request;
+}
+
+
+void
+FastCGIServer::Connection::unschedule(RequestInfo* request)
+{
+    if (!request->ready)
+        return;
+    if (request->ready_prev)
+        request->ready_prev->ready_next = request->ready_next;
+    else
+        ready_first = request->ready_next;
+    if (request->ready_next)
+        request->ready_next->ready_prev = request->ready_prev;
+    else
+        ready_last = request->ready_prev;
+    request->ready = false;
+    request->ready_prev = request->ready_next = 0;
+}
+
+
+FastCGIServer::TimerWheel::TimerWheel() :
+    current(now() / 1000000),
+    now_tick(current)
+{
+    for (unsigned i = 0; i <= levels * slots; i++)
+        heads[i].prev = heads[i].next = &heads[i];
+    for (unsigned level = 0; level < levels; level++)
+        occupied[level] = 0;
+}
+
+
+void
+FastCGIServer::TimerWheel::Timer::cancel()
+{
+    if (!next)
+        return;
+    prev->next = next;
+    next->prev = prev;
+    if (next == prev && slot < levels * slots) // left the slot empty
+        wheel->occupied[slot >> slot_bits] &= ~(1ULL << (slot & (slots - 1)));
+    prev = next = 0;
+    wheel = 0;
+}
+
+
+void
+FastCGIServer::TimerWheel::link(Timer& timer, unsigned slot)
+{
+    Link& head = heads[slot];
+    timer.prev = head.prev;
+    timer.next = &head;
+    head.prev->next = &timer;
+    head.prev = &timer;
+    timer.wheel = this;
+    timer.slot = slot;
+    if (slot < levels * slots)
+        occupied[slot >> slot_bits] |= 1ULL << (slot & (slots - 1));
+}
+
+
+void
+FastCGIServer::TimerWheel::insert(Timer& timer)
+{
+    // the level of the highest digit in which it differs from the current
+    // tick, so that it is moved down once all the digits above match;  a
+    // timer more than a turn of the top level away waits there a turn
+    unsigned long long differ = timer.expiry ^ current;
+    unsigned level = 0;
+    while (level < levels - 1 && (differ >> ((level + 1) * slot_bits)) != 0)
+        level++;
+    link(timer, level * slots +
+        ((timer.expiry >> (level * slot_bits)) & (slots - 1)));
+}
+
+
+void
+FastCGIServer::TimerWheel::arm(Timer& timer, unsigned ms)
+{
+    timer.cancel();
+    timer.expiry = now_tick + (ms ? ms : 1);
+    insert(timer);
+}
+
+
+FastCGIServer::OverloadControl::OverloadControl() :
+    target(0),
+    interval(0),
+    interval_end(0),
+    least(~0ULL),
+    state(false)
+{
+}
+
+
+void
+FastCGIServer::OverloadControl::configure(unsigned long long p_target,
+                                          unsigned long long p_interval)
+{
+    target = p_target;
+    interval = p_interval;
+}
+
+
+bool
+FastCGIServer::OverloadControl::shed(unsigned long long waited,
+                                     unsigned long long time)
+{
+    if (!target)
+        return false;
+
+    unsigned long long end = interval_end.load(std::memory_order_relaxed);
+    if (time >= end && interval_end.compare_exchange_strong(end,
+            time + interval, std::memory_order_relaxed)) {
+        // a queue that never got short in a whole interval is standing
+        unsigned long long shortest =
+            least.exchange(waited, std::memory_order_relaxed);
+        state.store(shortest != ~0ULL && shortest > target,
+            std::memory_order_relaxed);
+    } else {
+        unsigned long long shortest = least.load(std::memory_order_relaxed);
+        while (waited < shortest && !least.compare_exchange_weak(shortest,
+                waited, std::memory_order_relaxed))
+            ;
+    }
+
+    // what has only just arrived is still worth handling
+    return state.load(std::memory_order_relaxed) && waited > 2 * target;
+}
+
+
+void
+FastCGIServer::TimerWheel::arm_by(Timer& timer, unsigned long long time)
+{
+    unsigned long long expiry =
+        std::max((time + 999999) / 1000000, now_tick + 1);
+    if (timer.armed() && timer.expiry <= expiry)
+        return;
+    timer.cancel();
+    timer.expiry = expiry;
+    insert(timer);
+}
+
+
+void
+FastCGIServer::TimerWheel::cascade(unsigned level)
+{
+    unsigned digit = (current >> (level * slot_bits)) & (slots - 1);
+    Link& head = heads[level * slots + digit];
+    if (head.next == &head)
+        return;
+
+    // take them all off first, since one more than a turn of the top level
+    // away goes back into the same slot
+    Link* link = head.next;
+    head.prev->next = 0;
+    head.prev = head.next = &head;
+    occupied[level] &= ~(1ULL << digit);
+    while (link) {
+        Timer& timer = static_cast<Timer&>(*link);
+        link = link->next;
+        timer.prev = timer.next = 0;
+        insert(timer); // a level lower at least, unless it waits a turn
+    }
+}
+
+
+unsigned long long
+FastCGIServer::TimerWheel::next_tick() const
+{
+    unsigned long long next = ~0ULL;
+    for (unsigned level = 0; level < levels; level++) {
+        if (!occupied[level])
+            continue;
+        // the slots after the current one, where a level below the top
+        // keeps all of its timers
+        unsigned shift = level * slot_bits;
+        unsigned digit = (current >> shift) & (slots - 1);
+        unsigned long long span = 1ULL << (shift + slot_bits);
+        unsigned long long base = current & ~(span - 1);
+        unsigned long long later = digit == slots - 1 ? 0 :
+            occupied[level] & (~0ULL << (digit + 1));
+        unsigned long long tick = later ?
+            base + ((unsigned long long)__builtin_ctzll(later) << shift) :
+            base + span +
+                ((unsigned long long)__builtin_ctzll(occupied[level]) << shift);
+        next = std::min(next, tick);
+    }
+    return next;
+}
+
+
+FastCGIServer::Timer*
+FastCGIServer::TimerWheel::expire()
+{
+    Link& due = heads[levels * slots];
+    while (current < now_tick) {
+        // straight to the next tick with something to do
+        unsigned long long next = next_tick();
+        if (next > now_tick) {
+            current = now_tick;
+            break;
+        }
+        current = next;
+
+        // from the top, so that timers move down as far as they can at once
+        for (unsigned level = levels - 1; level > 0; level--)
+            if ((current & ((1ULL << (level * slot_bits)) - 1)) == 0)
+                cascade(level);
+
+        Link& head = heads[current & (slots - 1)];
+        while (head.next != &head) {
+            Timer& timer = static_cast<Timer&>(*head.next);
+            timer.cancel();
+            link(timer, levels * slots);
+        }
+    }
+
+    if (due.next == &due)
+        return 0;
+    Timer& timer = static_cast<Timer&>(*due.next);
+    timer.cancel();
+    return &timer;
+}
+
+
+int
+FastCGIServer::TimerWheel::timeout() const
+{
+    const Link& due = heads[levels * slots];
+    if (due.next != &due)
+        return 0;
+    unsigned long long next = next_tick();
+    if (next == ~0ULL)
+        return -1;
+    if (next <= now_tick)
+        return 0;
+    return std::min(next - now_tick,
+        static_cast<unsigned long long>(INT_MAX));
+}
+
+
+FastCGIServer::CompletionQueue::CompletionQueue() :
+    head(0),
+    closed(false)
+{
+#ifdef __linux__
+    read_fd = write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (read_fd == -1)
+        throw std::runtime_error("eventfd() failed");
+#else
+    int fds[2];
+    if (pipe(fds) == -1)
+        throw std::runtime_error("pipe() failed");
+    read_fd = fds[0];
+    write_fd = fds[1];
+    try {
+        set_nonblocking(read_fd);
+        set_nonblocking(write_fd);
+    } catch (...) {
+        close(read_fd);
+        close(write_fd);
+        throw;
+    }
+#endif
+}
+
+
+FastCGIServer::CompletionQueue::~CompletionQueue()
+{
+    discard(detach());
+    close(read_fd);
+    if (write_fd != read_fd)
+        close(write_fd);
+}
+
+
+void
+FastCGIServer::CompletionQueue::post(
+    const std::shared_ptr<FastCGIDeferred::State>& state)
+{
+    if (closed.load(std::memory_order_acquire))
+        return;
+    // already queued, whoever takes it will see what has changed since
+    if (state->posted.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    FastCGIDeferred::State* raw = state.get();
+    raw->queued = state;
+    FastCGIDeferred::State* first = head.load(std::memory_order_relaxed);
+    do
+        raw->next = first;
+    while (!head.compare_exchange_weak(first, raw,
+        std::memory_order_release, std::memory_order_relaxed));
+
+    if (closed.load(std::memory_order_acquire)) {
+        // raced with shutdown(), which may have missed it
+        discard(detach());
+        return;
+    }
+    if (first)
+        return; // the one that found it empty signalled already
+
+    // a full pipe or a saturated counter already means there is a wakeup
+#ifdef __linux__
+    uint64_t one = 1;
+    while (write(write_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+#else
+    char one = 1;
+    while (write(write_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+#endif
+}
+
+
+void
+FastCGIServer::CompletionQueue::shutdown()
+{
+    closed.store(true, std::memory_order_release);
+    discard(detach());
+}
+
+
+FastCGIDeferred::State*
+FastCGIServer::CompletionQueue::detach()
+{
+    return head.exchange(0, std::memory_order_acquire);
+}
+
+
+void
+FastCGIServer::CompletionQueue::discard(FastCGIDeferred::State* state)
+{
+    while (state) {
+        FastCGIDeferred::State* next = state->next;
+        state->next = 0;
+        std::shared_ptr<FastCGIDeferred::State> reference;
+        reference.swap(state->queued); // may be the last one
+        state = next;
+    }
+}
+
+
+void
+FastCGIServer::CompletionQueue::take(
+    std::vector<std::shared_ptr<FastCGIDeferred::State> >& states)
+{
+    char buffer[64];
+    for (;;) {
+        ssize_t read_result = read(read_fd, buffer, sizeof(buffer));
+        if (read_result > 0 && write_fd != read_fd)
+            continue; // more bytes in the pipe
+        if (read_result == -1 && errno == EINTR)
+            continue;
+        break;
+    }
+
+    // posts from here on signal again
+    std::vector<std::shared_ptr<FastCGIDeferred::State> >::size_type
+        oldest = states.size();
+    for (FastCGIDeferred::State* state = detach(); state;) {
+        FastCGIDeferred::State* next = state->next;
+        state->next = 0;
+        states.push_back(std::shared_ptr<FastCGIDeferred::State>());
+        states.back().swap(state->queued);
+        // after this a post queues it again
+        state->posted.exchange(false, std::memory_order_acq_rel);
+        state = next;
+    }
+    std::reverse(states.begin() + oldest, states.end());
+}
+
+
+int
+FastCGIServer::HandlerBase::operator()(FastCGIRequest&)
+{
+    return 0;
+}
+
+
+FastCGIServer::FastCGIServer() :
+#ifdef __linux__
+    poller(new FastCGIEpollPoller),
+#else
+    poller(new FastCGISelectPoller),
+#endif
+    round_time(0),
+    build_params_map(true),
+    listen_queue(100),
+    accept_limit(64),
+    request_input_limit(0),
+    output_limit(0x40000),
+    idle_limit(0),
+    read_limit(60000),
+    request_limit(0),
+    handler_limit(0),
+    deadline_default(0),
+    no_bid("Status: 204 No Content\r\n\r\n"),
+    connection_max(0),
+    request_max(0),
+    multiplexing(true),
+    workers(1),
+    handle_request(new HandlerBase),
+    handle_data(new HandlerBase),
+    handle_complete(new HandlerBase),
+    complete_pool(0),
+    pooled(0)
+{
+    overload_response(
+        "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n");
+}
+
+
+FastCGIServer::~FastCGIServer()
+{
+    if (completions)
+        completions->shutdown();
+
+    for (std::vector<int>::iterator it = listen_sockets.begin();
+            it != listen_sockets.end(); ++it)
+        close(*it);
+
+    for (std::vector<std::string>::iterator it = listen_unlink.begin();
+            it != listen_unlink.end(); ++it)
+        unlink(it->c_str());
+
+    for (std::vector<Connection*>::size_type fd = 0;
+            fd < connections.size(); ++fd) {
+        if (!connections[fd])
+            continue;
+        close(fd);
+        delete connections[fd];
+    }
+
+    // the requests are gone, so tasks still waiting on the pool find them
+    // abandoned and only the handlers already running take time
+    {
+        std::unique_lock<std::mutex> lock(pooled_mutex);
+        while (pooled)
+            pooled_done.wait(lock);
+    }
+
+    delete poller;
+    delete handle_request;
+    delete handle_data;
+    delete handle_complete;
+}
+
+
+void
+FastCGIServer::request_handler(int (* function)(FastCGIRequest&))
+{
+    handle_request = new StaticHandler(function);
+}
+
+
+void
+FastCGIServer::data_handler(int (* function)(FastCGIRequest&))
+{
+    handle_data = new StaticHandler(function);
+}
+
+
+void
+FastCGIServer::complete_handler(int (* function)(FastCGIRequest&))
+{
+    handle_complete = new StaticHandler(function);
+}
+
+
+void
+FastCGIServer::set_handler(HandlerBase*& handler, HandlerBase* new_handler)
+{
+    delete handler;
+    handler = new_handler;
+}
+
+
+int
+FastCGIServer::run_handler(HandlerBase* handler, FastCGIRequest& request)
+{
+    unsigned long long start = now();
+    int status = (*handler)(request);
+    ThreadStats::local().record(Stats::handler, now() - start);
+    return status;
+}
+
+
+void
+FastCGIServer::set_poller(FastCGIPoller* new_poller)
+{
+    try {
+        for (std::vector<int>::const_iterator it = listen_sockets.begin();
+                it != listen_sockets.end(); ++it)
+            new_poller->add(*it, FastCGIPoller::readable);
+
+        for (std::vector<Connection*>::size_type fd = 0;
+                fd < connections.size(); ++fd)
+            if (connections[fd])
+                new_poller->add(fd, connections[fd]->events);
+
+        if (completions)
+            new_poller->add(completions->descriptor(), FastCGIPoller::readable);
+    } catch (...) {
+        delete new_poller;
+        throw;
+    }
+
+    delete poller;
+    poller = new_poller;
+}
+
+
+void
+FastCGIServer::add_listen_socket(int listen_socket)
+{
+    set_nonblocking(listen_socket);
+    poller->add(listen_socket, FastCGIPoller::readable);
+    try {
+        listen_sockets.push_back(listen_socket);
+    } catch (...) {
+        poller->remove(listen_socket);
+        throw;
+    }
+}
+
+
+void
+FastCGIServer::listen(unsigned tcp_port, bool reuse_port)
+{
+    int listen_socket = socket(PF_INET, SOCK_STREAM, 0);
+    if (listen_socket == -1)
+        throw std::runtime_error("socket() failed");
+
+    try {
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            int on = 1;
+            if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT,
+                    &on, sizeof(on)) == -1)
+                throw std::runtime_error("setsockopt() failed");
+#else
+            throw std::runtime_error("SO_REUSEPORT not supported");
+#endif
+        }
+
+        struct sockaddr_in sa;
+        bzero(&sa, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(tcp_port);
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        if (bind(listen_socket, (struct sockaddr*)&sa, sizeof(sa)) == -1)
+            throw std::runtime_error("bind() failed");
+
+        if (::listen(listen_socket, listen_queue))
+            throw std::runtime_error("listen() failed");
+
+        add_listen_socket(listen_socket);
+
+    } catch (...) {
+        close(listen_socket);
+        throw;
+    }
+}
+
+
+void
+FastCGIServer::listen(const std::string& local_path)
+{
+    int listen_socket = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == -1)
+        throw std::runtime_error("socket() failed");
+
+    try {
+        struct sockaddr_un sa;
+        bzero(&sa, sizeof(sa));
+        sa.sun_family = AF_LOCAL;
+
+        std::string::size_type size = local_path.size();
+        if (size >= sizeof(sa.sun_path))
+            throw std::runtime_error("path too long");
+        if (local_path.find_first_of('\0') != std::string::npos)
+            throw std::runtime_error("null character in path");
+
+        std::memcpy(sa.sun_path, local_path.data(), size);
+
+        unlink(local_path.c_str());
+        try {
+            if (bind(listen_socket, (struct sockaddr*)&sa,
+                    sizeof(sa) - (sizeof(sa.sun_path) - size - 1)) == -1)
+                throw std::runtime_error("bind() failed");
+
+            if (::listen(listen_socket, listen_queue))
+                throw std::runtime_error("listen() failed");
+
+            listen_unlink.push_back(local_path);
+            try {
+                add_listen_socket(listen_socket);
+            } catch (...) {
+                listen_unlink.pop_back();
+                throw;
+            }
+
+        } catch (...) {
+            unlink(local_path.c_str());
+            throw;
+        }
+
+    } catch (...) {
+        close(listen_socket);
+        throw;
+    }
+}
+
+
+void
+FastCGIServer::listen_descriptor(int listen_socket)
+{
+    try {
+        add_listen_socket(listen_socket);
+    } catch (...) {
+        close(listen_socket);
+        throw;
+    }
+}
+
+
+void
+FastCGIServer::overload_target(unsigned target_ms, unsigned interval_ms)
+{
+    overload.configure(target_ms * 1000000ULL, interval_ms * 1000000ULL);
+}
+
+
+void
+FastCGIServer::overload_response(const std::string& response)
+{
+    if (response.size() > 0xffff)
+        throw std::runtime_error("overload response too long");
+    static const char padding[8] = { 0 };
+
+    std::string records;
+    FCGI_Header header;
+    bzero(&header, sizeof(header));
+    header.version = FCGI_VERSION_1;
+    header.type = FCGI_STDOUT;
+    header.contentLengthB1 = response.size() >> 8;
+    header.contentLengthB0 = response.size() & 0xff;
+    header.paddingLength = (8 - (response.size() % 8)) % 8;
+    records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    records.append(response);
+    records.append(padding, header.paddingLength);
+
+    header.contentLengthB1 = header.contentLengthB0 = 0;
+    header.paddingLength = 0;
+    records.append(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    FCGI_EndRequestRecord complete;
+    bzero(&complete, sizeof(complete));
+    complete.header.version = FCGI_VERSION_1;
+    complete.header.type = FCGI_END_REQUEST;
+    complete.header.contentLengthB0 = sizeof(complete.body);
+    complete.body.protocolStatus = FCGI_REQUEST_COMPLETE;
+    records.append(reinterpret_cast<const char*>(&complete), sizeof(complete));
+
+    overload_text = response;
+    overload_records.swap(records);
+}
+
+
+void
+FastCGIServer::abandon_files()
+{
+    listen_unlink.clear();
+}
+
+
+void
+FastCGIServer::process(int timeout_ms)
+{
+    poller->wait(ready_events,
+        pending_accepts.empty() ? wait_timeout(timeout_ms) : 0);
+    round_time = now();
+    timers.set_time(round_time);
+
+    if (!pending_accepts.empty()) {
+        std::vector<int> retry;
+        retry.swap(pending_accepts);
+        for (std::vector<int>::const_iterator it = retry.begin();
+                it != retry.end(); ++it)
+            accept_connections(*it);
+    }
+
+    for (std::vector<FastCGIPoller::Event>::const_iterator it =
+            ready_events.begin(); it != ready_events.end(); ++it) {
+        int fd = it->fd;
+
+        if (completions && fd == completions->descriptor()) {
+            process_completions();
+            continue;
+        }
+
+        if (std::find(listen_sockets.begin(), listen_sockets.end(), fd) !=
+                listen_sockets.end()) {
+            accept_connections(fd);
+            continue;
+        }
+
+        // may have been closed while handling an earlier event
+        if (static_cast<std::vector<Connection*>::size_type>(fd) >=
+                connections.size() || !connections[fd])
+            continue;
+        Connection& connection = *connections[fd];
+
+        if (it->events & FastCGIPoller::readable)
+            read_connection(fd, connection);
+        flush_connection(fd, connection);
+    }
+
+    std::vector<int> flush;
+    expire_timers(flush);
+    for (std::vector<int>::const_iterator it = flush.begin();
+            it != flush.end(); ++it)
+        if (connections[*it])
+            flush_connection(*it, *connections[*it]);
+}
+
+
+int
+FastCGIServer::wait_timeout(int timeout_ms)
+{
+    timers.set_time(now());
+    int timer_ms = timers.timeout();
+    if (timer_ms >= 0 && (timeout_ms < 0 || timer_ms < timeout_ms))
+        return timer_ms;
+    return timeout_ms;
+}
+
+
+void
+FastCGIServer::update_timers(Connection& connection)
+{
+    if (idle_limit && connection.requests.size() == 0 &&
+            connection.drained() && !connection.close_socket) {
+        if (!connection.idle_timer.armed())
+            timers.arm(connection.idle_timer, idle_limit);
+    } else
+        connection.idle_timer.cancel();
+
+    // whatever is left over after parsing is part of a record;  parsing a
+    // whole one cancels it, so that the deadline is per record
+    if (read_limit && !connection.input_buffer.empty() &&
+            !connection.paused && !connection.close_socket) {
+        if (!connection.read_timer.armed())
+            timers.arm(connection.read_timer, read_limit);
+    } else
+        connection.read_timer.cancel();
+}
+
+
+void
+FastCGIServer::expire_timers(std::vector<int>& flush)
+{
+    while (Timer* timer = timers.expire()) {
+        Connection& connection = timer->connection ?
+            *timer->connection : *timer->request->connection;
+        int fd = connection.read_socket;
+        switch (timer->kind) {
+        case Timer::idle_deadline:
+            connection.close_socket = true;
+            break;
+        case Timer::read_deadline:
+            connection.reset = true; // the peer has stalled
+            bump(ThreadStats::local().timeouts);
+            break;
+        case Timer::request_deadline:
+        case Timer::handler_deadline: {
+            RequestInfo& request = *timer->request;
+            if (request.completed || request.status != 0)
+                break; // answered, only not sent yet
+            // the request timer is armed for the sooner of its timeout and
+            // its deadline
+            bool expired = timer->kind == Timer::request_deadline &&
+                request.deadline && request.remaining() <= 0;
+            end_request(request, expired);
+            bump(expired ? ThreadStats::local().expired :
+                ThreadStats::local().timeouts);
+            break;
+        }
+        }
+        if (std::find(flush.begin(), flush.end(), fd) == flush.end())
+            flush.push_back(fd);
+    }
+}
+
+
+void
+FastCGIServer::refuse_request(Connection& connection, RequestID id,
+                              unsigned char status)
+{
+    FCGI_EndRequestRecord refused;
+    bzero(&refused, sizeof(refused));
+    refused.header.version = FCGI_VERSION_1;
+    refused.header.type = FCGI_END_REQUEST;
+    refused.header.requestIdB1 = (id >> 8) & 0xff;
+    refused.header.requestIdB0 = id & 0xff;
+    refused.header.contentLengthB0 = sizeof(refused.body);
+    refused.body.protocolStatus = status;
+    connection.output_buffer.append(
+        reinterpret_cast<const char*>(&refused), sizeof(refused));
+    if (connection.close_responsibility)
+        connection.close_socket = true;
+}
+
+
+void
+FastCGIServer::end_request(RequestInfo& request, bool expired)
+{
+    Connection& connection = *request.connection;
+    RequestID id = request.id;
+
+    // once part of a response is out, the rest can't be a no-bid instead,
+    // so it is ended as failed like one that timed out
+    if (request.output_started)
+        expired = false;
+    if (expired) {
+        std::string response(no_bid);
+        write_data(connection.output_buffer, id, response, FCGI_STDOUT);
+    }
+    if (expired || request.output_started) {
+        // the empty record that ends the stream
+        std::string none;
+        write_data(connection.output_buffer, id, none, FCGI_STDOUT);
+    }
+
+    FCGI_EndRequestRecord ended;
+    bzero(&ended, sizeof(ended));
+    ended.header.version = FCGI_VERSION_1;
+    ended.header.type = FCGI_END_REQUEST;
+    ended.header.requestIdB1 = (id >> 8) & 0xff;
+    ended.header.requestIdB0 = id & 0xff;
+    ended.header.contentLengthB0 = sizeof(ended.body);
+    ended.body.appStatusB0 = expired ? 0 : 1;
+    ended.body.protocolStatus = FCGI_REQUEST_COMPLETE;
+    connection.output_buffer.append(
+        reinterpret_cast<const char*>(&ended), sizeof(ended));
+    if (connection.close_responsibility)
+        connection.close_socket = true;
+
+    // a handle or coroutine still holding it finds it abandoned
+    connection.unschedule(&request);
+    connection.requests.erase(id);
+    RequestPool::local().release(&request);
+}
+
+
+void
+FastCGIServer::set_deadline(RequestInfo& request)
+{
+    unsigned long long budget = deadline_default;
+    std::string_view value = request.env.get(deadline_name);
+    if (!value.empty()) {
+        unsigned long long ms = 0;
+        std::string_view::size_type i = 0;
+        while (i < value.size() && value[i] >= '0' && value[i] <= '9' &&
+                ms < 1000000000)
+            ms = ms * 10 + (value[i++] - '0');
+        if (i == value.size())
+            budget = ms;
+    }
+    if (!budget)
+        return;
+
+    request.deadline = request.begin_time + budget * 1000000;
+    timers.arm_by(request.request_timer, request.deadline);
+}
+
+
+bool
+FastCGIServer::past_deadline(RequestInfo& request)
+{
+    if (!request.deadline || request.remaining() > 0)
+        return false;
+    // the same as a handler answering it, only the handler doesn't run
+    request.out.assign(no_bid);
+    request.completed = true;
+    bump(ThreadStats::local().expired);
+    return true;
+}
+
+
+bool
+FastCGIServer::shed(RequestInfo& request)
+{
+    ThreadStats& thread_stats = ThreadStats::local();
+    unsigned long long time = now();
+    // the input was there to read from the start of the round at least, so
+    // the handlers run since then for other connections count as well
+    unsigned long long since = request.complete_time;
+    if (round_time != 0 && round_time < since)
+        since = round_time;
+    thread_stats.record(Stats::queued, time - since);
+    if (!overload.shed(time - since, time))
+        return false;
+
+    // whatever its data handler has written goes first
+    Connection& connection = *request.connection;
+    write_streams(connection, request);
+
+    // only the request ID differs from one to the next;  the records are
+    // shared by the loop's threads, so the IDs go into copies of the headers
+    for (std::string::size_type n = 0; n < overload_records.size();) {
+        FCGI_Header header;
+        std::memcpy(&header, &overload_records[n], sizeof(header));
+        header.requestIdB1 = (request.id >> 8) & 0xff;
+        header.requestIdB0 = request.id & 0xff;
+        std::string::size_type body = (header.contentLengthB1 << 8) +
+            header.contentLengthB0 + header.paddingLength;
+        connection.output_buffer.append(
+            reinterpret_cast<const char*>(&header), sizeof(header));
+        connection.output_buffer.append(
+            overload_records.data() + n + FCGI_HEADER_LEN, body);
+        n += FCGI_HEADER_LEN + body;
+    }
+    if (connection.close_responsibility)
+        connection.close_socket = true;
+
+    Connection::FlushMark mark;
+    mark.position = connection.output_buffer.consumed() +
+        connection.output_buffer.size();
+    mark.complete_time = request.complete_time;
+    connection.flush_marks.push_back(mark);
+
+    // released once scheduled, like any other request that has ended
+    request.completed = true;
+    request.output_closed = true;
+    bump(thread_stats.shed);
+    return true;
+}
+
+
+void
+FastCGIServer::flush_connection(int read_socket, Connection& connection)
+{
+    if (connection.paused && input_caught_up(connection)) {
+        connection.paused = false;
+        process_connection_read(connection);
+        // an edge-triggered poller won't tell about what arrived meanwhile
+        read_connection(read_socket, connection);
+    }
+
+    // the socket is usually writable, so don't wait another round to
+    // send what the handlers have just produced, and what those waiting for
+    // it to drain produce next
+    do {
+        if (!connection.reset && connection.has_output())
+            write_connection(read_socket, connection);
+    } while (!connection.reset && wake_drained(connection));
+
+    if (connection.reset ||
+            (connection.close_socket && connection.drained()))
+        close_connection(read_socket);
+    else {
+        update_timers(connection);
+        unsigned events =
+            (connection.paused ? 0 : FastCGIPoller::readable) |
+            (connection.output_buffer.empty() ? 0 : FastCGIPoller::writable);
+        if (connection.events != events) {
+            connection.events = events;
+            poller->modify(read_socket, events);
+        }
+    }
+}
+
+
+bool
+FastCGIServer::input_caught_up(const Connection& connection) const
+{
+    return !connection.blocked ||
+        connection.blocked->in.size() <= request_input_limit / 2;
+}
+
+
+void
+FastCGIServer::process_completions()
+{
+    completed.clear();
+    completions->take(completed);
+
+    // hand everything over first, so that each connection is written once
+    std::vector<int> flush;
+    for (std::vector<std::shared_ptr<FastCGIDeferred::State> >::iterator it =
+            completed.begin(); it != completed.end(); ++it) {
+        Connection* connection = resume_deferred(**it);
+        if (connection && std::find(flush.begin(), flush.end(),
+                connection->read_socket) == flush.end())
+            flush.push_back(connection->read_socket);
+    }
+    completed.clear();
+
+    for (std::vector<int>::const_iterator it = flush.begin();
+            it != flush.end(); ++it)
+        if (connections[*it])
+            flush_connection(*it, *connections[*it]);
+}
+
+
+void
+FastCGIServer::accept_connections(int listen_socket)
+{
+    for (unsigned accepted = 0;; accepted++) {
+        if (accepted == accept_limit && accept_limit != 0) {
+            if (std::find(pending_accepts.begin(), pending_accepts.end(),
+                    listen_socket) == pending_accepts.end())
+                pending_accepts.push_back(listen_socket);
+            return;
+        }
+
+#ifdef SOCK_NONBLOCK
+        int read_socket = accept4(listen_socket, NULL, NULL,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int read_socket = accept(listen_socket, NULL, NULL);
+#endif
+        if (read_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EMFILE || errno == ENFILE)
+                return;
+            throw std::runtime_error("accept() failed");
+        }
+
+        Connection* connection = 0;
+        try {
+#ifndef SOCK_NONBLOCK
+            set_nonblocking(read_socket);
+#endif
+#ifdef SO_NOSIGPIPE
+            int on = 1;
+            setsockopt(read_socket, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            if (!completions) {
+                completions.reset(new CompletionQueue);
+                try {
+                    poller->add(completions->descriptor(),
+                        FastCGIPoller::readable);
+                } catch (...) {
+                    completions.reset();
+                    throw;
+                }
+            }
+
+            connection = new Connection;
+            if (!admit(*connection)) {
+                delete connection;
+                close(read_socket);
+                continue;
+            }
+            connection->read_socket = read_socket;
+            connection->output_watermark = output_limit;
+            connection->completer = completions;
+            if (static_cast<std::vector<Connection*>::size_type>(read_socket)
+                    >= connections.size())
+                connections.resize(read_socket + 1);
+            poller->add(read_socket, FastCGIPoller::readable);
+            connections[read_socket] = connection;
+            update_timers(*connection);
+        } catch (...) {
+            delete connection;
+            close(read_socket);
+            throw;
+        }
+    }
+}
+
+
+void
+FastCGIServer::read_connection(int read_socket, Connection& connection)
+{
+    while (!connection.close_socket && !connection.paused) {
+        std::string::size_type available;
+        char* buffer = connection.input_buffer.prepare(16384, available);
+        int read_result = read(read_socket, buffer, available);
+        if (read_result == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == ECONNRESET) {
+                connection.reset = true;
+                break;
+            }
+            throw std::runtime_error("read() on socket failed");
+        }
+        if (read_result == 0)
+            connection.close_socket = true;
+        else {
+            connection.input_buffer.commit(read_result);
+            process_connection_read(connection);
+        }
+    }
+}
+
+
+void
+FastCGIServer::write_connection(int read_socket, Connection& connection)
+{
+    process_connection_write(connection);
+
+    while (!connection.output_buffer.empty()) {
+        ssize_t write_result;
+        std::string::size_type offered = 0;
+#ifdef __linux__
+        // file pieces go straight from the page cache to the socket
+        int file;
+        off_t offset;
+        std::string::size_type n;
+        if (connection.output_buffer.front_file(file, offset, n)) {
+            offered = n;
+            write_result = sendfile(read_socket, file, &offset, n);
+            if (write_result == 0) {
+                // the file got shorter than what was framed
+                connection.reset = true;
+                break;
+            }
+        } else
+#endif
+        {
+            struct iovec iov[64];
+            struct msghdr message;
+            bzero(&message, sizeof(message));
+            message.msg_iov = iov;
+            int flags = MSG_NOSIGNAL;
+#ifdef __linux__
+            message.msg_iovlen = connection.output_buffer.gather(iov, 64);
+            if (connection.output_buffer.file_at(message.msg_iovlen))
+                flags |= MSG_MORE; // the header before the file's data
+#else
+            message.msg_iovlen = connection.output_buffer.gather(iov, 64,
+                true);
+#endif
+            for (std::size_t i = 0; i < message.msg_iovlen; i++)
+                offered += iov[i].iov_len;
+            write_result = sendmsg(read_socket, &message, flags);
+        }
+        if (write_result == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sent(connection, 0, offered);
+                break;
+            }
+            if (errno == EPIPE || errno == ECONNRESET) {
+                connection.reset = true;
+                break;
+            }
+            throw std::runtime_error("sending on socket failed");
+        }
+        sent(connection, write_result, offered);
+    }
+}
+
+
+void
+FastCGIServer::close_connection(int read_socket)
+{
+    Connection* connection = connections[read_socket];
+    connections[read_socket] = 0;
+
+    poller->remove(read_socket);
+    int close_result = close(read_socket);
+    delete connection;
+
+    if (close_result == -1 && errno != ECONNRESET)
+        throw std::runtime_error("close() failed");
+}
+
+
+bool
+FastCGIServer::admit(Connection& connection)
+{
+    // counted first, so that threads accepting together can't overshoot
+    unsigned open = load.connections.fetch_add(1, std::memory_order_relaxed);
+    if (connection_max != 0 && open >= connection_max) {
+        load.connections.fetch_sub(1, std::memory_order_relaxed);
+        bump(ThreadStats::local().connections_refused);
+        return false;
+    }
+    connection.load = &load;
+    connection.requests.count_in(&load.requests);
+    return true;
+}
+
+
+void
+FastCGIServer::process_forever()
+{
+    for (;;)
+        process();
+}
+
+
+void
+FastCGIServer::process_connection_read(Connection& connection)
+{
+    ThreadStats& thread_stats = ThreadStats::local();
+    unsigned long long batch_time = now(); // for all records parsed here
+
+    std::string::size_type n = 0;
+    unsigned records = 0;
+    while (connection.input_buffer.size() - n >= FCGI_HEADER_LEN) {
+        const FCGI_Header& header = *reinterpret_cast<const FCGI_Header*>(
+            connection.input_buffer.data() + n);
+        if (header.version != FCGI_VERSION_1) {
+            connection.close_socket = true;
+            break;
+        }
+
+        unsigned content_length =
+            (header.contentLengthB1 << 8) + header.contentLengthB0;
+        if (connection.input_buffer.size() - n <
+                FCGI_HEADER_LEN + content_length + header.paddingLength)
+            break;
+        const char* content =
+            connection.input_buffer.data() + n + FCGI_HEADER_LEN;
+
+        RequestID request_id = (header.requestIdB1 << 8) + header.requestIdB0;
+
+        switch (header.type) {
+        case FCGI_GET_VALUES: {
+            Pairs pairs = parse_pairs(content, content_length);
+
+            std::string result;
+            result.push_back(FCGI_VERSION_1);
+            result.push_back(FCGI_GET_VALUES_RESULT);
+            result.append(FCGI_HEADER_LEN - 2, 0);
+
+            // for the whole application, so the limits of all workers
+            unsigned long long max_conns, max_reqs;
+            if (connection_max != 0)
+                max_conns = static_cast<unsigned long long>(connection_max) *
+                    workers;
+            else {
+                // each connection takes a descriptor of the process
+                struct rlimit files;
+                max_conns = getrlimit(RLIMIT_NOFILE, &files) == 0 &&
+                    files.rlim_cur != RLIM_INFINITY ? files.rlim_cur : INT_MAX;
+            }
+            // with multiplexing, nothing but max_requests() says how many
+            // requests it can take on, so without it none is advertised (0)
+            max_reqs = multiplexing ? 0 : max_conns;
+            if (request_max != 0) {
+                unsigned long long limit =
+                    static_cast<unsigned long long>(request_max) * workers;
+                max_reqs = max_reqs ? std::min(max_reqs, limit) : limit;
+            }
+
+            for (Pairs::iterator it = pairs.begin(); it != pairs.end(); ++it) {
+                char value[24];
+                if (it->first == FCGI_MAX_CONNS)
+                    snprintf(value, sizeof(value), "%llu", max_conns);
+                else if (it->first == FCGI_MAX_REQS && max_reqs != 0)
+                    snprintf(value, sizeof(value), "%llu", max_reqs);
+                else if (it->first == FCGI_MPXS_CONNS)
+                    snprintf(value, sizeof(value), "%d", multiplexing);
+                else
+                    continue;
+                write_pair(result, it->first, std::string(value));
+            }
+
+            std::string::size_type len = result.size() - FCGI_HEADER_LEN;
+            result[4] = (len >> 8) & 0xff;
+            result[5] = len & 0xff;
+            connection.output_buffer.append(result);
+            break;
+        }
+        case FCGI_BEGIN_REQUEST: {
+            if (content_length < sizeof(FCGI_BeginRequestBody))
+                break;
+            const FCGI_BeginRequestBody& body =
+                *reinterpret_cast<const FCGI_BeginRequestBody*>(content);
+
+            if (!(body.flags & FCGI_KEEP_CONN))
+                connection.close_responsibility = true;
+
+            unsigned role = (body.roleB1 << 8) + body.roleB0;
+            if (role != FCGI_RESPONDER) {
+                refuse_request(connection, request_id, FCGI_UNKNOWN_ROLE);
+                break;
+            }
+
+            // one that begins again under the same ID takes the old one's
+            // place rather than adding to the load
+            RequestInfo* old_request = connection.requests.find(request_id);
+            unsigned open = connection.requests.size() - (old_request ? 1 : 0);
+            if (!multiplexing && open != 0) {
+                refuse_request(connection, request_id, FCGI_CANT_MPX_CONN);
+                bump(thread_stats.requests_refused);
+                break;
+            }
+            if (request_max != 0 && !old_request &&
+                    load.requests.load(std::memory_order_relaxed) >=
+                        request_max) {
+                refuse_request(connection, request_id, FCGI_OVERLOADED);
+                bump(thread_stats.requests_refused);
+                break;
+            }
+
+            if (old_request) {
+                connection.unschedule(old_request);
+                connection.requests.erase(request_id);
+                RequestPool::local().release(old_request);
+            }
+
+            RequestInfo* new_request = RequestPool::local().acquire();
+            new_request->connection = &connection;
+            new_request->id = request_id;
+            new_request->begin_time = connection.accept_time ?
+                connection.accept_time : batch_time;
+            connection.accept_time = 0;
+            try {
+                connection.requests.insert(new_request);
+            } catch (...) {
+                RequestPool::local().release(new_request);
+                throw;
+            }
+            if (request_limit)
+                timers.arm(new_request->request_timer, request_limit);
+            break;
+        }
+        case FCGI_ABORT_REQUEST: {
+            RequestInfo* request = connection.requests.find(request_id);
+            if (!request)
+                break;
+
+            FCGI_EndRequestRecord aborted;
+            bzero(&aborted, sizeof(aborted));
+            aborted.header.version = FCGI_VERSION_1;
+            aborted.header.type = FCGI_END_REQUEST;
+            aborted.header.requestIdB1 = (request_id >> 8) & 0xff;
+            aborted.header.requestIdB0 = request_id & 0xff;
+            aborted.header.contentLengthB0 = sizeof(aborted.body);
+            aborted.body.appStatusB0 = 1;
+            aborted.body.protocolStatus = FCGI_REQUEST_COMPLETE;
+            connection.output_buffer.append(
+                reinterpret_cast<const char*>(&aborted), sizeof(aborted));
+            if (connection.close_responsibility)
+                connection.close_socket = true;
+
+            connection.unschedule(request);
+            connection.requests.erase(request_id);
+            RequestPool::local().release(request);
+            bump(thread_stats.aborts);
+            break;
+        }
+        case FCGI_PARAMS: {
+            RequestInfo* found = connection.requests.find(request_id);
+            if (!found)
                 break;
 
-            RequestInfo& request = *it->second;
+            RequestInfo& request = *found;
 	    if (!request.params_closed) {
 		if (content_length != 0)
 		    request.params_buffer.append(content, content_length);
 		else {
-                    request.params = parse_pairs(request.params_buffer.data(),
+                    // the views point into params_buffer, which stays put
+                    // until the request goes away
+                    request.env.parse(request.params_buffer.data(),
                         request.params_buffer.size());
-                    request.params_buffer.clear();
+                    if (build_params_map)
+                        for (FastCGIParams::const_iterator it =
+                                request.env.begin();
+                                it != request.env.end(); ++it)
+                            request.params.insert(
+                                FastCGIRequest::Params::value_type(
+                                    std::string(it->first),
+                                    std::string(it->second)));
                     request.params_closed = true;
+                    request.params_time = batch_time;
+                    if (!deadline_name.empty() || deadline_default)
+                        set_deadline(request);
+                    thread_stats.record(Stats::to_params,
+                        batch_time - request.begin_time);
+                    if (request.in_closed) {
+                        request.complete_time = batch_time;
+                        thread_stats.record(Stats::to_complete, 0);
+                        if (handler_limit)
+                            timers.arm(request.handler_timer, handler_limit);
+                    }
 
-                    request.status = (*handle_request)(request);
-                    if (request.status == 0 && !request.in.empty()) {
-                        request.status = (*handle_data)(request);
-                        if (request.status == 0 && request.in_closed)
-                            request.status = (*handle_complete)(request);
+                    if (request.status == 0 && stats_request(request)) {
+                        request.out.append("Content-Type: text/plain; "
+                            "version=0.0.4\r\n\r\n");
+                        render_stats(request.out);
+                        request.completed = true;
+                    } else if (request.status == 0 && !past_deadline(request))
+                        // not ended over its input, nor too late for it
+                        request.status = run_handler(handle_request, request);
+                    if (request.continuation)
+                        // started by the request handler, which has seen
+                        // the input so far
+                        take_completion(request);
+                    else if (!request.handlers_done() && !request.in.empty()) {
+                        request.status = run_handler(handle_data, request);
+                        if (!request.handlers_done() && request.in_closed)
+                            request.status = complete_request(request);
                     }
-                    process_write_request(connection, request_id, request);
+                    connection.schedule(&request);
 		}
 	    }
             break;
         }
         case FCGI_STDIN: {
-            RequestList::iterator it = connection.requests.find(request_id);
-	    if (it == connection.requests.end())
+            RequestInfo* found = connection.requests.find(request_id);
+	    if (!found)
 		break;
 
-            RequestInfo& request = *it->second;
+            RequestInfo& request = *found;
 	    if (!request.in_closed) {
-                if (content_length != 0) {
+                // a record too big for the limit on its own is still let
+                // through to a coroutine, which would otherwise never see it
+                if (content_length != 0 && request_input_limit != 0 &&
+                        request.in.size() + content_length >
+                            request_input_limit &&
+                        !(request.continuation && request.in.empty())) {
+                    if (request.continuation) {
+                        // parse the record again once it has caught up
+                        connection.paused = true;
+                        connection.blocked = &request;
+                    } else {
+                        // nothing will consume it
+                        request.in.clear();
+                        if (request.status == 0)
+                            request.status = 1;
+                        connection.schedule(&request);
+                    }
+                } else if (content_length != 0) {
                     request.in.append(content, content_length);
-                    if (request.params_closed && request.status == 0) {
-                        request.status = (*handle_data)(request);
-                        process_write_request(connection, request_id, request);
+                    if (request.params_closed && request.continuation) {
+                        continue_request(request);
+                        connection.schedule(&request);
+                    } else if (request.params_closed &&
+                            !request.handlers_done()) {
+                        request.status = run_handler(handle_data, request);
+                        connection.schedule(&request);
                     }
                 } else {
                     request.in_closed = true;
-                    if (request.params_closed && request.status == 0) {
-                        request.status = (*handle_complete)(request);
-                        process_write_request(connection, request_id, request);
+                    if (request.params_closed) {
+                        request.complete_time = batch_time;
+                        thread_stats.record(Stats::to_complete,
+                            batch_time - request.params_time);
+                        if (handler_limit)
+                            timers.arm(request.handler_timer, handler_limit);
+                    }
+                    if (request.params_closed && request.continuation) {
+                        continue_request(request);
+                        connection.schedule(&request);
+                    } else if (request.params_closed &&
+                            !request.handlers_done()) {
+                        request.status = complete_request(request);
+                        connection.schedule(&request);
                     }
 		}
 	    }
@@ -489,111 +2816,495 @@ FastCGIServer::process_connection_read(Connection& connection)
                 reinterpret_cast<const char*>(&unknown), sizeof(unknown));
         }
         }
-
-        n += FCGI_HEADER_LEN + content_length + header.paddingLength;
+
+        if (connection.paused)
+            break;
+        n += FCGI_HEADER_LEN + content_length + header.paddingLength;
+        ++records;
+    }
+
+    connection.input_buffer.consume(n);
+    if (n != 0) {
+        // progress, update_timers() starts them again from here if needed
+        connection.idle_timer.cancel();
+        connection.read_timer.cancel();
+    }
+    bump(thread_stats.records, records);
+    bump(thread_stats.bytes_received, n);
+}
+
+
+void
+FastCGIServer::process_write_request(Connection& connection,
+                                     RequestInfo& request)
+{
+    RequestID id = request.id;
+    write_streams(connection, request);
+    if ((request.in_closed || request.status != 0 || request.completed) &&
+            !request.deferred && !request.output_closed) {
+        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
+        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
+
+        FCGI_EndRequestRecord complete;
+        bzero(&complete, sizeof(complete));
+        complete.header.version = FCGI_VERSION_1;
+        complete.header.type = FCGI_END_REQUEST;
+        complete.header.requestIdB1 = (id >> 8) & 0xff;
+        complete.header.requestIdB0 = id & 0xff;
+        complete.header.contentLengthB0 = sizeof(complete.body);
+        complete.body.appStatusB3 = (request.status >> 24) & 0xff;
+        complete.body.appStatusB2 = (request.status >> 16) & 0xff;
+        complete.body.appStatusB1 = (request.status >> 8) & 0xff;
+        complete.body.appStatusB0 = request.status & 0xff;
+        complete.body.protocolStatus = FCGI_REQUEST_COMPLETE;
+        connection.output_buffer.append(
+            reinterpret_cast<const char*>(&complete), sizeof(complete));
+        if (connection.close_responsibility)
+            connection.close_socket = true;
+
+        Connection::FlushMark mark;
+        mark.position = connection.output_buffer.consumed() +
+            connection.output_buffer.size();
+        mark.complete_time = request.complete_time ?
+            request.complete_time : now(); // ended before its input
+        connection.flush_marks.push_back(mark);
+
+        request.output_closed = true;
+    }
+}
+
+
+void
+FastCGIServer::sent(Connection& connection, std::string::size_type n,
+                    std::string::size_type offered)
+{
+    ThreadStats& thread_stats = ThreadStats::local();
+    bump(thread_stats.bytes_sent, n);
+    if (n < offered)
+        bump(thread_stats.partial_writes);
+
+    connection.output_buffer.consume(n);
+    unsigned long long sent_time = 0;
+    while (!connection.flush_marks.empty() &&
+            connection.flush_marks.front().position <=
+                connection.output_buffer.consumed()) {
+        if (!sent_time)
+            sent_time = now();
+        thread_stats.record(Stats::to_flushed,
+            sent_time - connection.flush_marks.front().complete_time);
+        connection.flush_marks.pop_front();
+    }
+}
+
+
+void
+FastCGIServer::write_streams(Connection& connection, RequestInfo& request)
+{
+    if (!request.out.empty()) {
+        write_data(connection.output_buffer, request.id, request.out,
+            FCGI_STDOUT);
+        request.out.clear();
+        request.output_started = true;
+    }
+    if (!request.err.empty()) {
+        write_data(connection.output_buffer, request.id, request.err,
+            FCGI_STDERR);
+        request.err.clear();
+    }
+}
+
+
+bool
+FastCGIServer::wake_drained(Connection& connection)
+{
+    if (connection.drain_waiters.empty() ||
+            connection.output_buffer.size() > connection.output_watermark / 2)
+        return false;
+
+    std::vector<RequestInfo*> waiters;
+    waiters.swap(connection.drain_waiters);
+    for (std::vector<RequestInfo*>::iterator it = waiters.begin();
+            it != waiters.end(); ++it) {
+        RequestInfo& request = **it;
+        request.drain_waiting = false;
+        if (request.continuation) {
+            request.continuation->drained(request);
+            take_completion(request);
+        }
+        connection.schedule(&request);
+    }
+    return true;
+}
+
+
+void
+FastCGIServer::process_connection_write(Connection& connection)
+{
+    while (RequestInfo* request = connection.ready_first) {
+        connection.unschedule(request);
+        process_write_request(connection, *request);
+        if (request->output_closed) {
+            // anything else the web server sends for it is ignored
+            connection.requests.erase(request->id);
+            RequestPool::local().release(request);
+        }
+    }
+}
+
+
+FastCGIDeferred
+FastCGIServer::defer(FastCGIRequest& p_request)
+{
+    RequestInfo& request = static_cast<RequestInfo&>(p_request);
+    if (!request.connection) {
+        // on a pool thread, where the request is already answered through
+        // a handle;  what the handler has written so far goes first
+        FastCGIDeferred response(request.deferred);
+        response.out().append(request.out);
+        response.err().append(request.err);
+        request.out.clear();
+        request.err.clear();
+        request.completed = true; // left to whoever completes the handle
+        return response;
+    }
+    if (!request.deferred) {
+        request.deferred = std::make_shared<FastCGIDeferred::State>();
+        request.deferred->request = &request;
+        request.deferred->completer = request.connection->completer;
+        ++request.connection->deferred_requests;
+    }
+    return FastCGIDeferred(request.deferred);
+}
+
+
+FastCGIServer::Connection*
+FastCGIServer::resume_deferred(FastCGIDeferred::State& state)
+{
+    if (!state.request)
+        return 0; // released, or completed by an earlier post
+    RequestInfo& request = static_cast<RequestInfo&>(*state.request);
+
+    if (!state.finished.load(std::memory_order_acquire)) {
+        if (!request.continuation)
+            return 0;
+        request.continuation->wake(request);
+        if (!state.finished.load(std::memory_order_acquire)) {
+            request.connection->schedule(&request);
+            return request.connection;
+        }
+    }
+
+    Connection* connection = request.connection;
+    complete_deferred(state);
+    return connection;
+}
+
+
+void
+FastCGIServer::continue_request(RequestInfo& request)
+{
+    request.continuation->input(request);
+    take_completion(request);
+}
+
+
+void
+FastCGIServer::take_completion(RequestInfo& request)
+{
+    // completed on this thread, no need to wait for the post to come round
+    std::shared_ptr<FastCGIDeferred::State> state(request.deferred);
+    if (state && state->finished.load(std::memory_order_acquire))
+        complete_deferred(*state);
+}
+
+
+void
+FastCGIServer::complete_deferred(FastCGIDeferred::State& state)
+{
+    RequestInfo& request = static_cast<RequestInfo&>(*state.request);
+    state.request = 0;
+
+    if (request.out.empty())
+        request.out.swap(state.out); // typically all of it, from a pool
+    else
+        request.out.append(state.out);
+    request.err.append(state.err);
+    request.status = state.status;
+    request.completed = true;
+    request.deferred.reset();
+    --request.connection->deferred_requests;
+    request.connection->schedule(&request);
+}
+
+
+bool
+FastCGIServer::stats_request(const RequestInfo& request) const
+{
+    if (stats_path.empty())
+        return false;
+
+    std::string_view uri = request.env.get(FastCGIParams::REQUEST_URI);
+    std::string_view::size_type query = uri.find('?');
+    if (query != std::string_view::npos)
+        uri = uri.substr(0, query);
+    return uri == stats_path ||
+        request.env.get(FastCGIParams::SCRIPT_NAME) == stats_path;
+}
+
+
+static void
+append_metric(std::string& out, const char* name, const char* type,
+              const char* help, unsigned long long value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+        name, help, name, type, name, value);
+    out.append(line);
+}
+
+
+void
+FastCGIServer::render_stats(std::string& out) const
+{
+    Stats all = stats();
+    append_metric(out, "fcgicc_records_received_total", "counter",
+        "FastCGI records received.", all.records);
+    append_metric(out, "fcgicc_received_bytes_total", "counter",
+        "Bytes received from web servers.", all.bytes_received);
+    append_metric(out, "fcgicc_sent_bytes_total", "counter",
+        "Bytes sent to web servers.", all.bytes_sent);
+    append_metric(out, "fcgicc_partial_writes_total", "counter",
+        "Writes that sent less than was ready.", all.partial_writes);
+    append_metric(out, "fcgicc_aborted_requests_total", "counter",
+        "Requests aborted by the web server.", all.aborts);
+    append_metric(out, "fcgicc_timeouts_total", "counter",
+        "Requests ended and connections dropped by a deadline.",
+        all.timeouts);
+    append_metric(out, "fcgicc_expired_requests_total", "counter",
+        "Requests answered with the no-bid response past their deadline.",
+        all.expired);
+    append_metric(out, "fcgicc_shed_requests_total", "counter",
+        "Requests answered with the overload response.", all.shed);
+    append_metric(out, "fcgicc_overloaded", "gauge",
+        "Whether requests waiting too long are being shed.",
+        overload.overloaded());
+    append_metric(out, "fcgicc_refused_connections_total", "counter",
+        "Connections closed on arrival over the connection limit.",
+        all.connections_refused);
+    append_metric(out, "fcgicc_refused_requests_total", "counter",
+        "Requests refused over the request limit or without multiplexing.",
+        all.requests_refused);
+    append_metric(out, "fcgicc_connections_total", "counter",
+        "Connections accepted.", all.connections_opened);
+    append_metric(out, "fcgicc_connections", "gauge",
+        "Connections open.", all.connections_opened - all.connections_closed);
+    append_metric(out, "fcgicc_requests_total", "counter",
+        "Requests begun.", all.requests_started);
+    append_metric(out, "fcgicc_requests_in_flight", "gauge",
+        "Requests begun and not yet ended.",
+        all.requests_started - all.requests_finished);
+
+    PoolStats pool = pool_stats();
+    append_metric(out, "fcgicc_request_pool_hits_total", "counter",
+        "Requests that reused a pooled object.", pool.hits);
+    append_metric(out, "fcgicc_request_pool_misses_total", "counter",
+        "Requests that allocated a new object.", pool.misses);
+    append_metric(out, "fcgicc_request_pool_cached", "gauge",
+        "Request objects waiting to be reused.", pool.cached);
+
+    if (complete_pool) {
+        FastCGIHandlerPool::Stats handlers = complete_pool->stats();
+        append_metric(out, "fcgicc_handler_pool_threads", "gauge",
+            "Threads running complete handlers.", handlers.threads);
+        append_metric(out, "fcgicc_handler_pool_queued", "gauge",
+            "Requests waiting for a handler thread.", handlers.queued);
+        append_metric(out, "fcgicc_handler_pool_executed_total", "counter",
+            "Requests run by handler threads.", handlers.executed);
+        append_metric(out, "fcgicc_handler_pool_stolen_total", "counter",
+            "Requests run by another thread than queued on.",
+            handlers.stolen);
+        append_metric(out, "fcgicc_handler_pool_rejected_total", "counter",
+            "Requests run on the loop as the pool was full.",
+            handlers.rejected);
+    }
+
+    if (!listen_sockets.empty()) {
+        // this loop's own, the only ones it may look at
+        unsigned long long open = 0, queued = 0, deferred = 0, paused = 0;
+        for (std::vector<Connection*>::const_iterator it =
+                connections.begin(); it != connections.end(); ++it)
+            if (*it) {
+                open++;
+                queued += (*it)->output_buffer.size();
+                deferred += (*it)->deferred_requests;
+                paused += (*it)->paused;
+            }
+        append_metric(out, "fcgicc_worker_connections", "gauge",
+            "Connections of the answering worker.", open);
+        append_metric(out, "fcgicc_worker_output_queued_bytes", "gauge",
+            "Bytes waiting to be sent by the answering worker.", queued);
+        append_metric(out, "fcgicc_worker_deferred_requests", "gauge",
+            "Deferred requests of the answering worker.", deferred);
+        append_metric(out, "fcgicc_worker_paused_connections", "gauge",
+            "Connections not read until a request catches up.", paused);
+    }
+
+    static const char* const stages[Stats::stage_count] = {
+        "to_params", "to_complete", "queued", "handler", "to_flushed"
+    };
+    static const double bounds[] = {
+        1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3, 1e-2,
+        2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+    out.append("# HELP fcgicc_duration_seconds Time spent in each stage "
+        "of a request.\n# TYPE fcgicc_duration_seconds histogram\n");
+    char line[256];
+    for (unsigned stage = 0; stage < Stats::stage_count; stage++) {
+        const FastCGIHistogram& histogram = all.latency[stage];
+
+        // a bucket counts once all of it is below the bound
+        unsigned bucket = 0;
+        unsigned long long cumulative = 0;
+        for (unsigned i = 0; i < sizeof(bounds) / sizeof(bounds[0]); i++) {
+            unsigned long long bound = bounds[i] * 1e9;
+            while (bucket + 1 < FastCGIHistogram::buckets &&
+                    FastCGIHistogram::lowest(bucket + 1) <= bound + 1)
+                cumulative += histogram.counts[bucket++];
+            snprintf(line, sizeof(line),
+                "fcgicc_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} "
+                "%llu\n", stages[stage], bounds[i], cumulative);
+            out.append(line);
+        }
+        while (bucket < FastCGIHistogram::buckets)
+            cumulative += histogram.counts[bucket++];
+        snprintf(line, sizeof(line),
+            "fcgicc_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} "
+            "%llu\n"
+            "fcgicc_duration_seconds_sum{stage=\"%s\"} %.9f\n"
+            "fcgicc_duration_seconds_count{stage=\"%s\"} %llu\n",
+            stages[stage], cumulative, stages[stage], histogram.sum / 1e9,
+            stages[stage], cumulative);
+        out.append(line);
+    }
+}
+
+
+// A request handed to a FastCGIHandlerPool, with its own copy of what the
+// complete handler may look at, so that the loop is free to release the
+// original if the request is aborted meanwhile.  The copy has no connection,
+// which tells defer() and FastCGIWriter that it is not on the loop's thread.
+class FastCGIServer::PooledRequest : public FastCGIHandlerPool::Task {
+public:
+    PooledRequest(RequestInfo& original, FastCGIServer& p_server) :
+        response(defer(original)), server(p_server),
+        queued_time(original.complete_time)
+    {
+        const char* params_data = original.params_buffer.data();
+        params_buffer.swap(original.params_buffer);
+        request.params.swap(original.params);
+        std::swap(request.env, original.env);
+        request.in.swap(original.in);
+        request.in_closed = true;
+        request.deadline = original.deadline;
+        request.deferred = original.deferred;
+
+        // short strings move their contents along with them
+        if (params_buffer.data() != params_data)
+            request.env.parse(params_buffer.data(), params_buffer.size());
+
+        std::lock_guard<std::mutex> lock(server.pooled_mutex);
+        server.pooled++;
+    }
+
+    ~PooledRequest()
+    {
+        // the last use of the server, which may go away as soon as it's told
+        std::lock_guard<std::mutex> lock(server.pooled_mutex);
+        if (--server.pooled == 0)
+            server.pooled_done.notify_all();
+    }
+
+    void run()
+    {
+        if (response.abandoned())
+            return;
+        ThreadStats& thread_stats = ThreadStats::local();
+        unsigned long long time = now();
+        thread_stats.record(Stats::queued, time - queued_time);
+        if (request.deadline && request.remaining() <= 0) {
+            // waited in the queue for too long
+            response.out() = server.no_bid;
+            bump(thread_stats.expired);
+            response.complete(0);
+            return;
+        }
+        if (server.overload.shed(time - queued_time, time)) {
+            response.out() = server.overload_text;
+            bump(thread_stats.shed);
+            response.complete(0);
+            return;
+        }
+        int status;
+        try {
+            status = run_handler(server.handle_complete, request);
+        } catch (const std::exception& e) {
+            // there is no loop to throw from, so tell the web server
+            request.err.append(e.what());
+            status = 1;
+        } catch (...) {
+            status = 1;
+        }
+        if (request.completed)
+            return; // the handler deferred it
+        response.out().swap(request.out);
+        response.err().swap(request.err);
+        response.complete(status);
     }
 
-    connection.input_buffer.erase(0, n);
-}
+private:
+    RequestInfo request;
+    std::string params_buffer;
+    FastCGIDeferred response;
+    FastCGIServer& server; // which waits for the task to be deleted
+    unsigned long long queued_time;
+};
 
 
-void
-FastCGIServer::process_write_request(Connection& connection, RequestID id,
-                                     RequestInfo& request)
+int
+FastCGIServer::complete_request(RequestInfo& request)
 {
-    if (!request.out.empty()) {
-        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
-        request.out.clear();
-    }
-    if (!request.err.empty()) {
-        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
-        request.err.clear();
+    if (past_deadline(request))
+        return 0;
+    if (!complete_pool) {
+        if (shed(request))
+            return 0;
+        return run_handler(handle_complete, request);
     }
-    if ((request.in_closed || request.status != 0) &&
-            !request.output_closed) {
-        write_data(connection.output_buffer, id, request.out, FCGI_STDOUT);
-        write_data(connection.output_buffer, id, request.err, FCGI_STDERR);
-
-        FCGI_EndRequestRecord complete;
-        bzero(&complete, sizeof(complete));
-        complete.header.version = FCGI_VERSION_1;
-        complete.header.type = FCGI_END_REQUEST;
-        complete.header.requestIdB1 = (id >> 8) & 0xff;
-        complete.header.requestIdB0 = id & 0xff;
-        complete.header.contentLengthB0 = sizeof(complete.body);
-        complete.body.appStatusB3 = (request.status >> 24) & 0xff;
-        complete.body.appStatusB2 = (request.status >> 16) & 0xff;
-        complete.body.appStatusB1 = (request.status >> 8) & 0xff;
-        complete.body.appStatusB0 = request.status & 0xff;
-        complete.body.protocolStatus = FCGI_REQUEST_COMPLETE;
-        connection.output_buffer.append(
-            reinterpret_cast<const char*>(&complete), sizeof(complete));
-        if (connection.close_responsibility)
-            connection.close_socket = true;
 
-        request.output_closed = true;
+    std::unique_ptr<PooledRequest> task(new PooledRequest(request, *this));
+    if (complete_pool->submit(task.get())) {
+        task.release();
+        return 0;
     }
-}
 
-
-void
-FastCGIServer::process_connection_write(Connection& connection)
-{
-    for (RequestList::iterator it = connection.requests.begin();
-            it != connection.requests.end();) {
-        process_write_request(connection, it->first, *it->second);
-        if (it->second->params_closed && it->second->in_closed) {
-            RequestInfo* request = it->second;
-            connection.requests.erase(it++);
-            delete request;
-        } else
-            ++it;
-    }
+    // the pool is full, so it runs here after all
+    task->run();
+    take_completion(request);
+    return request.status;
 }
 
 
 FastCGIServer::Pairs
 FastCGIServer::parse_pairs(const char* data, std::string::size_type n)
 {
-    Pairs pairs;
-
-    const unsigned char* u = reinterpret_cast<const unsigned char*>(data);
-
-    for (std::string::size_type m = 0; m < n;) {
-        std::string::size_type name_length, value_length;
-
-        if (u[m] >> 7) {
-            if (n - m < 4)
-                break;
-            name_length = ((u[m] & 0x7f) << 24) + (u[m + 1] << 16) +
-                (u[m + 2] << 8) + u[m + 3];
-            m += 4;
-        } else
-            name_length = u[m++];
-        if (m >= n)
-            break;
-
-        if (u[m] >> 7) {
-            if (n - m < 4)
-                break;
-            value_length = ((u[m] & 0x7f) << 24) + (u[m + 1] << 16) +
-                (u[m + 2] << 8) + u[m + 3];
-            m += 4;
-        } else
-            value_length = u[m++];
-
-        if (n - m < name_length)
-            break;
-        std::string key(data + m, name_length);
-        m += name_length;
+    FastCGIParams params;
+    params.parse(data, n);
 
-        if (n - m < value_length)
-            break;
+    Pairs pairs;
+    for (FastCGIParams::const_iterator it = params.begin();
+            it != params.end(); ++it)
         pairs.insert(Pairs::value_type(
-            key, std::string(data + m, value_length)));
-        m += value_length;
-    }
-
+            std::string(it->first), std::string(it->second)));
     return pairs;
 }
 
@@ -624,9 +3335,11 @@ FastCGIServer::write_pair(std::string& buffer,
 
 
 void
-FastCGIServer::write_data(std::string& buffer, RequestID id,
-                          const std::string& input, unsigned char type)
+FastCGIServer::write_data(OutputQueue& buffer, RequestID id,
+                          std::string& input, unsigned char type)
 {
+    static const char padding[8] = { 0 };
+
     FCGI_Header header;
     bzero(&header, sizeof(header));
     header.version = FCGI_VERSION_1;
@@ -634,8 +3347,14 @@ FastCGIServer::write_data(std::string& buffer, RequestID id,
     header.requestIdB1 = (id >> 8) & 0xff;
     header.requestIdB0 = id & 0xff;
 
+    // short output is cheaper to copy than to send as a separate piece
+    OutputQueue::Buffer* payload = 0;
+    if (input.size() > 256)
+        payload = buffer.adopt(input);
+    const std::string& data = payload ? payload->data : input;
+
     for (std::string::size_type n = 0;;) {
-        std::string::size_type written = std::min(input.size() - n,
+        std::string::size_type written = std::min(data.size() - n,
             (std::string::size_type)0xffffu);
 
         header.contentLengthB1 = written >> 8;
@@ -643,11 +3362,355 @@ FastCGIServer::write_data(std::string& buffer, RequestID id,
         header.paddingLength = (8 - (written % 8)) % 8;
         buffer.append(
             reinterpret_cast<const char*>(&header), sizeof(header));
-        buffer.append(input.data() + n, written);
-        buffer.append(header.paddingLength, 0);
+        if (payload)
+            buffer.append(payload, n, written);
+        else
+            buffer.append(data.data() + n, written);
+        buffer.append(padding, header.paddingLength);
 
         n += written;
-        if (n == input.size())
+        if (n == data.size())
             break;
     }
+
+    input.clear();
+}
+
+
+void
+FastCGIServer::write_file(OutputQueue& buffer, RequestID id, int file,
+                          off_t offset, std::string::size_type length)
+{
+    static const char padding[8] = { 0 };
+
+    FCGI_Header header;
+    bzero(&header, sizeof(header));
+    header.version = FCGI_VERSION_1;
+    header.type = FCGI_STDOUT;
+    header.requestIdB1 = (id >> 8) & 0xff;
+    header.requestIdB0 = id & 0xff;
+
+    OutputQueue::Buffer* payload =
+        buffer.adopt_file(file, offset, offset + length);
+    for (std::string::size_type n = 0; n != length;) {
+        // whole multiples of 8, so only the last record needs padding
+        std::string::size_type written = std::min(length - n,
+            (std::string::size_type)0xfff8u);
+
+        header.contentLengthB1 = written >> 8;
+        header.contentLengthB0 = written & 0xff;
+        header.paddingLength = (8 - (written % 8)) % 8;
+        buffer.append(
+            reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.append(payload, offset + n, written);
+        buffer.append(padding, header.paddingLength);
+
+        n += written;
+    }
+}
+
+
+FastCGIServerGroup::FastCGIServerGroup(unsigned workers)
+{
+    if (workers == 0)
+        workers = std::max(std::thread::hardware_concurrency(), 1u);
+
+    try {
+        for (unsigned i = 0; i < workers; i++) {
+            servers.push_back(0);
+            servers.back() = new FastCGIServer;
+            servers.back()->workers = workers;
+        }
+    } catch (...) {
+        for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+                it != servers.end(); ++it)
+            delete *it;
+        throw;
+    }
+}
+
+
+FastCGIServerGroup::~FastCGIServerGroup()
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        delete *it;
+}
+
+
+void
+FastCGIServerGroup::request_handler(int (* function)(FastCGIRequest&))
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->set_handler((*it)->handle_request,
+            new FastCGIServer::StaticHandler(function));
+}
+
+
+void
+FastCGIServerGroup::data_handler(int (* function)(FastCGIRequest&))
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->set_handler((*it)->handle_data,
+            new FastCGIServer::StaticHandler(function));
+}
+
+
+void
+FastCGIServerGroup::complete_handler(int (* function)(FastCGIRequest&))
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->set_handler((*it)->handle_complete,
+            new FastCGIServer::StaticHandler(function));
+}
+
+
+void
+FastCGIServerGroup::params_map(bool enabled)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->params_map(enabled);
+}
+
+
+void
+FastCGIServerGroup::input_limit(std::string::size_type bytes)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->input_limit(bytes);
+}
+
+
+void
+FastCGIServerGroup::idle_timeout(unsigned ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->idle_timeout(ms);
+}
+
+
+void
+FastCGIServerGroup::read_timeout(unsigned ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->read_timeout(ms);
+}
+
+
+void
+FastCGIServerGroup::request_timeout(unsigned ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->request_timeout(ms);
+}
+
+
+void
+FastCGIServerGroup::handler_timeout(unsigned ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->handler_timeout(ms);
+}
+
+
+void
+FastCGIServerGroup::deadline_param(const std::string& name,
+                                   unsigned default_ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->deadline_param(name, default_ms);
+}
+
+
+void
+FastCGIServerGroup::no_bid_response(const std::string& response)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->no_bid_response(response);
+}
+
+
+void
+FastCGIServerGroup::overload_target(unsigned target_ms, unsigned interval_ms)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->overload_target(target_ms, interval_ms);
+}
+
+
+void
+FastCGIServerGroup::overload_response(const std::string& response)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->overload_response(response);
+}
+
+
+void
+FastCGIServerGroup::max_connections(unsigned connections)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->max_connections(connections);
+}
+
+
+void
+FastCGIServerGroup::max_requests(unsigned requests)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->max_requests(requests);
+}
+
+
+void
+FastCGIServerGroup::multiplex(bool enabled)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->multiplex(enabled);
+}
+
+
+void
+FastCGIServerGroup::output_watermark(std::string::size_type bytes)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->output_watermark(bytes);
+}
+
+
+void
+FastCGIServerGroup::listen_backlog(int backlog)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->listen_backlog(backlog);
+}
+
+
+void
+FastCGIServerGroup::accept_budget(unsigned budget)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->accept_budget(budget);
+}
+
+
+void
+FastCGIServerGroup::handler_pool(FastCGIHandlerPool* pool)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->handler_pool(pool);
+}
+
+
+void
+FastCGIServerGroup::stats_route(const std::string& path)
+{
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->stats_route(path);
+}
+
+
+void
+FastCGIServerGroup::listen(unsigned tcp_port)
+{
+#ifdef SO_REUSEPORT
+    for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+            it != servers.end(); ++it)
+        (*it)->listen(tcp_port, servers.size() > 1);
+#else
+    servers.front()->listen(tcp_port);
+    share_listen_socket();
+#endif
+}
+
+
+void
+FastCGIServerGroup::listen(const std::string& local_path)
+{
+    // Linux doesn't balance local sockets with SO_REUSEPORT, so all workers
+    // accept from the same socket;  only the first one unlinks the path
+    servers.front()->listen(local_path);
+    share_listen_socket();
+}
+
+
+void
+FastCGIServerGroup::share_listen_socket()
+{
+    for (std::vector<FastCGIServer*>::size_type i = 1; i < servers.size();
+            i++) {
+        int listen_socket = dup(servers.front()->listen_sockets.back());
+        if (listen_socket == -1)
+            throw std::runtime_error("dup() failed");
+        servers[i]->listen_descriptor(listen_socket);
+    }
+}
+
+
+void
+FastCGIServerGroup::abandon_files()
+{
+    servers.front()->abandon_files();
+}
+
+
+void
+FastCGIServerGroup::process_forever()
+{
+    // the first worker to throw stops the others, which look every 100 ms,
+    // and its exception is passed on once they are all done
+    std::atomic<bool> stopping(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&](FastCGIServer* server) {
+        try {
+            while (!stopping.load(std::memory_order_relaxed))
+                server->process(100);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+                error = std::current_exception();
+            stopping.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    try {
+        for (std::vector<FastCGIServer*>::size_type i = 1;
+                i < servers.size(); i++)
+            threads.push_back(std::thread(work, servers[i]));
+    } catch (...) {
+        stopping.store(true, std::memory_order_relaxed);
+        for (std::vector<std::thread>::iterator it = threads.begin();
+                it != threads.end(); ++it)
+            it->join();
+        throw;
+    }
+
+    work(servers.front());
+    for (std::vector<std::thread>::iterator it = threads.begin();
+            it != threads.end(); ++it)
+        it->join();
+    std::rethrow_exception(error);
 }
@@ -35,19 +35,359 @@
 #ifndef FCGICC_H
 #define FCGICC_H
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include <sys/types.h> // off_t
+#include <sys/uio.h> // iovec
+
+#ifdef __linux__
+#include <sys/epoll.h> // epoll_event
+#endif
+
+
+// Request parameters as views into the received parameter stream, in the
+// order the web server sent them.  Well-known CGI variables are looked up by
+// index, without comparing names or building strings.
+class FastCGIParams {
+public:
+    enum Known {
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        DOCUMENT_ROOT,
+        DOCUMENT_URI,
+        GATEWAY_INTERFACE,
+        HTTPS,
+        HTTP_ACCEPT_ENCODING,
+        HTTP_COOKIE,
+        HTTP_HOST,
+        HTTP_REFERER,
+        HTTP_USER_AGENT,
+        QUERY_STRING,
+        REDIRECT_STATUS,
+        REMOTE_ADDR,
+        REMOTE_PORT,
+        REQUEST,
+        REQUEST_BODY,
+        REQUEST_METHOD,
+        REQUEST_SCHEME,
+        REQUEST_URI,
+        SCHEME,
+        SCRIPT_FILENAME,
+        SCRIPT_NAME,
+        SERVER_ADDR,
+        SERVER_NAME,
+        SERVER_PORT,
+        SERVER_PROTOCOL,
+        SERVER_SOFTWARE,
+        known_count
+    };
+
+    typedef std::pair<std::string_view, std::string_view> Pair;
+    typedef std::vector<Pair>::const_iterator const_iterator;
+
+    FastCGIParams() { clear(); }
+
+    bool has(Known name) const { return known[name] != 0; }
+    std::string_view get(Known name) const {
+        return known[name] ? pairs[known[name] - 1].second : std::string_view();
+    }
+    bool has(std::string_view name) const;
+    std::string_view get(std::string_view name) const; // empty if missing
+
+    const_iterator begin() const { return pairs.begin(); }
+    const_iterator end() const { return pairs.end(); }
+    std::vector<Pair>::size_type size() const { return pairs.size(); }
+
+    // views stay valid as long as the parsed data does;  of duplicate
+    // names, the first one wins
+    void parse(const char* data, std::string::size_type n);
+    void clear();
+
+    static const char* name(Known);
+
+protected:
+    std::vector<Pair> pairs;
+    unsigned known[known_count]; // 1-based index into pairs, 0 if missing
+};
+
 
 class FastCGIRequest {
 public:
     typedef std::map<std::string, std::string> Params;
 
-    Params params;
+    FastCGIRequest() : in_closed(false), deadline(0) {}
+
+    Params params; // empty unless FastCGIServer::params_map() is on
+    FastCGIParams env;
     std::string in;
+    bool in_closed; // all of the standard input is in
     std::string out;
     std::string err;
+
+    // when the web server stops waiting for the response, in CLOCK_MONOTONIC
+    // nanoseconds, see FastCGIServer::deadline_param();  0 if never
+    unsigned long long deadline;
+    // nanoseconds left until then, negative once past, LLONG_MAX if never
+    long long remaining() const;
+
+    // Lets a layer over the handlers take the request over (see
+    // fcgicc_coro.h).  Once set by the request handler, it gets new input
+    // instead of the data and complete handlers, and the wakeups of the
+    // request's FastCGIDeferred handle.  Destroyed with the request, also
+    // when it is aborted.
+    class Continuation {
+    public:
+        virtual ~Continuation() {}
+        virtual void input(FastCGIRequest&) = 0;
+        virtual void wake(FastCGIRequest&) = 0;
+        // after FastCGIWriter::wait_drained()
+        virtual void drained(FastCGIRequest&) {}
+    };
+    std::unique_ptr<Continuation> continuation;
+};
+
+
+// Handle for finishing a request after its handler has returned, from any
+// thread, see FastCGIServer::defer().  Copies refer to the same request.
+class FastCGIDeferred {
+public:
+    struct State;
+
+    // where a completed request is handed back to the thread that owns it
+    class Completer {
+    public:
+        virtual ~Completer() {}
+        virtual void post(const std::shared_ptr<State>&) = 0; // any thread
+    };
+
+    FastCGIDeferred() {}
+    explicit FastCGIDeferred(const std::shared_ptr<State>& p_state) :
+        state(p_state) {}
+
+    bool valid() const { return bool(state); }
+
+    // appended to the request's streams on completion;  only for whoever
+    // is going to call complete()
+    std::string& out();
+    std::string& err();
+
+    // sends the output followed by FCGI_END_REQUEST with status;  only the
+    // first call has an effect
+    void complete(int status = 0);
+
+    // has the request's continuation woken up on the thread owning it;
+    // wakes that arrive before the first has been handled count as one
+    void wake();
+
+    // the request was aborted or its connection closed, so nobody is
+    // waiting for the response any more
+    bool abandoned() const;
+
+private:
+    std::shared_ptr<State> state;
+};
+
+
+// Sends a response while it is being produced.  Output is framed into
+// FCGI_STDOUT records whenever a chunk's worth has accumulated, so it doesn't
+// pile up in request.out until the handler returns, and full() tells the
+// producer to hold off until the connection has sent what it has queued.
+// Only for the thread owning the request, like the request itself, and of
+// little use on a handler pool, see FastCGIServer::handler_pool().
+class FastCGIWriter {
+public:
+    explicit FastCGIWriter(FastCGIRequest& p_request,
+            std::string::size_type p_chunk = 32768) :
+        request(p_request), chunk(p_chunk) {}
+
+    void write(const char* data, std::string::size_type n) {
+        request.out.append(data, n);
+        if (request.out.size() >= chunk)
+            flush();
+    }
+    void write(std::string_view data) { write(data.data(), data.size()); }
+
+    // sends length bytes of the file from offset next, without reading them
+    // into memory;  takes ownership of file_descriptor and closes it once
+    // they are sent or the request goes away.  The file must not shrink
+    // meanwhile.
+    void send_file(int file_descriptor, off_t offset,
+        std::string::size_type length);
+
+    void flush(); // frames all of request.out and request.err now
+
+    // the connection has more output queued than its watermark, see
+    // FastCGIServer::output_watermark()
+    bool full() const;
+
+    // has the request's continuation told once the queued output is down to
+    // half the watermark;  returns false if it is already
+    bool wait_drained();
+
+private:
+    FastCGIRequest& request;
+    std::string::size_type chunk;
+};
+
+
+// Threads for handlers that take too long to run on a server's loop.  Every
+// thread has a deque of its own, which tasks submitted from outside are
+// spread over in turn;  a thread runs its own tasks oldest first and, once
+// it has none, steals the newest from the others.  May be shared by several
+// servers, see FastCGIServer::handler_pool().
+class FastCGIHandlerPool {
+public:
+    class Task {
+    public:
+        virtual ~Task() {}
+        virtual void run() = 0; // on a pool thread, which then deletes it
+    };
+
+    // 0 threads is one per CPU;  max_queued bounds the tasks waiting to
+    // run, 0 is no limit
+    explicit FastCGIHandlerPool(unsigned threads = 0,
+        unsigned max_queued = 0);
+    ~FastCGIHandlerPool(); // tasks still waiting are deleted without running
+
+    // takes ownership unless the pool is full, when it returns false
+    bool submit(Task*);
+
+    struct Stats {
+        unsigned threads;
+        unsigned queued; // waiting to run now
+        unsigned long long executed;
+        unsigned long long stolen; // run by another thread than queued on
+        unsigned long long rejected; // submitted while full
+    };
+    Stats stats() const;
+
+private:
+    struct Worker {
+        Worker() : executed(0), stolen(0) {}
+
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+        std::atomic<unsigned long long> executed;
+        std::atomic<unsigned long long> stolen;
+        std::thread thread;
+    };
+
+    void run(unsigned index);
+    void stop(); // joins the threads and deletes what is left
+    Task* take(unsigned index); // own or stolen, null if there are none
+
+    std::vector<Worker*> workers; // owned
+    unsigned limit;
+    std::atomic<unsigned> queued;
+    std::atomic<unsigned> next; // worker for the next outside submission
+    std::atomic<unsigned long long> rejected;
+
+    std::mutex sleep_mutex;
+    std::condition_variable wakeup;
+    std::atomic<unsigned> sleeping;
+    bool stopping;
+};
+
+
+// Readiness notification backend for FastCGIServer::process.  Sockets are
+// registered once and stay registered until they are closed, so a backend
+// that supports it only has to report the sockets that are actually ready.
+class FastCGIPoller {
+public:
+    enum { readable = 1, writable = 2 };
+
+    struct Event {
+        int fd;
+        unsigned events;
+    };
+
+    virtual ~FastCGIPoller() {}
+
+    // events is a combination of readable and writable
+    virtual void add(int fd, unsigned events) = 0;
+    virtual void modify(int fd, unsigned events) = 0;
+    virtual void remove(int fd) = 0;
+
+    // replaces the contents of ready; leaves it empty on timeout or EINTR
+    virtual void wait(std::vector<Event>& ready, int timeout_ms) = 0;
+};
+
+
+// Level-triggered select() backend, limited to descriptors below FD_SETSIZE
+class FastCGISelectPoller : public FastCGIPoller {
+public:
+    void add(int fd, unsigned events);
+    void modify(int fd, unsigned events);
+    void remove(int fd);
+    void wait(std::vector<Event>& ready, int timeout_ms);
+
+protected:
+    std::map<int, unsigned> registered;
+};
+
+
+#ifdef __linux__
+// Edge-triggered epoll backend.  Both directions stay armed for the lifetime
+// of a registration, so modify() costs nothing and the server is expected to
+// drain every ready socket until EAGAIN.
+class FastCGIEpollPoller : public FastCGIPoller {
+public:
+    FastCGIEpollPoller();
+    ~FastCGIEpollPoller();
+
+    void add(int fd, unsigned events);
+    void modify(int fd, unsigned events);
+    void remove(int fd);
+    void wait(std::vector<Event>& ready, int timeout_ms);
+
+protected:
+    int epoll_fd;
+    std::vector<struct epoll_event> buffer;
+};
+#endif
+
+
+// Distribution of durations in nanoseconds.  Buckets are a sixteenth of a
+// power of two wide, so a value is known to within about 6%, and adding one
+// is a shift and an increment.  Histograms of different threads are combined
+// with merge().
+class FastCGIHistogram {
+public:
+    enum { buckets = 61 * 16 };
+
+    FastCGIHistogram() { clear(); }
+
+    void clear();
+    void record(unsigned long long value) {
+        ++counts[bucket(value)];
+        sum += value;
+    }
+    void merge(const FastCGIHistogram&);
+
+    unsigned long long count() const;
+    // the value below which percent of them lie, to within a bucket
+    unsigned long long percentile(double percent) const;
+
+    static unsigned bucket(unsigned long long value) {
+        if (value < 16)
+            return value;
+        unsigned exponent = 63 - __builtin_clzll(value); // 4 or more
+        return (exponent - 3) * 16 + ((value >> (exponent - 4)) & 15);
+    }
+    static unsigned long long lowest(unsigned bucket); // of the bucket
+
+    unsigned long long counts[buckets];
+    unsigned long long sum;
 };
 
 
@@ -77,36 +417,581 @@ public:
         set_handler(handle_complete, new Handler<C>(object, function));
     }
 
-    void listen(unsigned tcp_port);
+    // whether to copy parameters into FastCGIRequest::params as well as
+    // providing FastCGIRequest::env;  on by default
+    void params_map(bool enabled) { build_params_map = enabled; }
+
+    // replaces the readiness backend, the server takes ownership;  the
+    // default is epoll on Linux and select() elsewhere
+    void set_poller(FastCGIPoller* new_poller);
+
+    // listen() queue length for sockets created from now on;  default 100
+    void listen_backlog(int backlog) { listen_queue = backlog; }
+
+    // Bounds the standard input a request may have waiting in request.in.
+    // A request taken over by a coroutine (see fcgicc_coro.h) that falls
+    // behind stops the connection from being read until it has consumed
+    // half of it;  any other request is ended with status 1 and its input
+    // dropped.  A record that would take request.in over the limit is held
+    // back whole, so the limit is exact, except that a coroutine with
+    // nothing waiting gets a record larger than the limit all the same.
+    // 0 is no limit, the default.
+    void input_limit(std::string::size_type bytes) {
+        request_input_limit = bytes;
+    }
+
+    // queued output above which FastCGIWriter::full() tells handlers to
+    // wait;  default 256 KB
+    void output_watermark(std::string::size_type bytes) {
+        output_limit = bytes;
+    }
+
+    // Runs the complete handler on the pool's threads instead of the loop's,
+    // so that a slow one doesn't hold up the other connections.  The request
+    // is handed over with its parameters and input and answered as if the
+    // handler had called defer(), only if the pool is full it runs on the
+    // loop as usual.  A handler on the pool may still call defer(), which
+    // takes what it has written so far;  after that, output goes through the
+    // handle only.  FastCGIWriter holds its output until the handler returns
+    // there, and send_file() throws.  The pool must outlive every server
+    // that uses it, and a server that goes away first waits for the handlers
+    // it has running there;  null, the default, runs everything on the
+    // loop.
+    void handler_pool(FastCGIHandlerPool* pool) { complete_pool = pool; }
+
+    // Answers requests for path, matched against REQUEST_URI without its
+    // query string or against SCRIPT_NAME, itself:  with stats(), pool
+    // usage and the queues of the answering worker, in the Prometheus text
+    // format.  No handler sees them.  Empty, the default, is no such path.
+    void stats_route(const std::string& path) { stats_path = path; }
+
+    // at most this many connections are accepted from one listening socket
+    // per process() round, the rest wait for the next one;  default 64,
+    // 0 is no limit
+    void accept_budget(unsigned budget) { accept_limit = budget; }
+
+    // Deadlines in milliseconds, 0 for none.  A connection is closed once it
+    // has gone idle_timeout without requests or output, and dropped when a
+    // record it has begun to send takes read_timeout to arrive in full.  A
+    // request still open request_timeout after it began, or handler_timeout
+    // after the end of its input, is ended with status 1.  By default only
+    // reading a record has a deadline, of 60 s.
+    void idle_timeout(unsigned ms) { idle_limit = ms; }
+    void read_timeout(unsigned ms) { read_limit = ms; }
+    void request_timeout(unsigned ms) { request_limit = ms; }
+    void handler_timeout(unsigned ms) { handler_limit = ms; }
+
+    // Gives requests a deadline, as RTB exchanges do:  the number of
+    // milliseconds from their arrival in the named parameter (headers are
+    // HTTP_*, and nginx can pass a query argument with fastcgi_param), or
+    // default_ms where it is missing, 0 for none.  A request that is past
+    // its deadline by the time a handler would see it is answered with the
+    // no-bid response instead, and so is one that hasn't been answered by
+    // then, unless part of its response has been sent, when it is ended with
+    // status 1.  Handlers can check FastCGIRequest::remaining().
+    void deadline_param(const std::string& name, unsigned default_ms = 0) {
+        deadline_name = name;
+        deadline_default = default_ms;
+    }
+    // headers and body;  default "Status: 204 No Content"
+    void no_bid_response(const std::string& response) { no_bid = response; }
+
+    // Sheds load the way CoDel drops packets.  Once the time requests wait
+    // for their complete handler to start has stayed above target_ms for a
+    // whole interval_ms, those that have waited more than twice the target
+    // are answered with the overload response instead of being handled,
+    // until the wait is below the target again.  On the loop, a request
+    // waits from the start of the round that reads the end of its input,
+    // behind the handlers of whatever is ready before it on any connection;
+    // on a handler pool, from the end of its input.  A target of 0, the
+    // default, sheds nothing.
+    void overload_target(unsigned target_ms, unsigned interval_ms = 100);
+    // headers and body, up to 64 KB;  default "Status: 503 Service
+    // Unavailable" with "Retry-After: 1"
+    void overload_response(const std::string& response);
+
+    // What the server takes on at once, as it answers FCGI_GET_VALUES.  A
+    // connection beyond max_connections is closed as soon as it is
+    // accepted, so that the web server tries another upstream, and a
+    // request beyond max_requests is refused with FCGI_OVERLOADED.  0, the
+    // default, is no limit, and then as many connections as the process
+    // may open descriptors are advertised, and as many requests only without
+    // multiplexing;  with it, FCGI_MAX_REQS goes unanswered.  Without
+    // multiplexing, on by default, a request on a connection that has one
+    // open already is refused with FCGI_CANT_MPX_CONN.
+    void max_connections(unsigned connections) {
+        connection_max = connections;
+    }
+    void max_requests(unsigned requests) { request_max = requests; }
+    void multiplex(bool enabled) { multiplexing = enabled; }
+
+    // reuse_port binds with SO_REUSEPORT so that several servers can listen
+    // on the same port and have the kernel balance connections between them
+    void listen(unsigned tcp_port, bool reuse_port = false);
     void listen(const std::string& local_path);
+    void listen_descriptor(int listen_socket); // takes ownership
     void abandon_files();
 
     void process(int timeout_ms = -1); // timeout_ms<0 blocks forever
     void process_forever();
 
+    // Called by a handler to respond later instead of before it returns.
+    // No more handlers are called for the request and it stays open, with
+    // whatever output it already has being sent, until the returned handle
+    // is completed.  The server's loop is woken up to send the rest.
+    static FastCGIDeferred defer(FastCGIRequest&);
+
+    // request objects are recycled per thread, with their buffers
+    struct PoolStats {
+        unsigned long long hits; // requests that reused a pooled object
+        unsigned long long misses; // requests that allocated a new one
+        unsigned long long cached; // objects waiting to be reused
+    };
+    static PoolStats pool_stats(); // all threads together
+
+    // What the server has been doing, always counted.  Every thread keeps
+    // its own, which its loop or pool writes without synchronization.
+    struct Stats {
+        enum Stage {
+            to_params, // from accept or FCGI_BEGIN_REQUEST to the parameters
+            to_complete, // from the parameters to the end of the input
+            queued, // from there to the complete handler starting
+            handler, // each run of a handler
+            to_flushed, // from the end of the input to the last byte sent
+            stage_count
+        };
+        FastCGIHistogram latency[stage_count];
+
+        unsigned long long records; // received
+        unsigned long long bytes_received;
+        unsigned long long bytes_sent;
+        unsigned long long partial_writes; // sent less than was ready
+        unsigned long long aborts; // by the web server
+        unsigned long long timeouts; // requests and connections ended
+        unsigned long long expired; // answered with the no-bid response
+        unsigned long long shed; // answered with the overload response
+        // over max_connections() and max_requests()
+        unsigned long long connections_refused;
+        unsigned long long requests_refused;
+        // the differences are what is open now
+        unsigned long long connections_opened;
+        unsigned long long connections_closed;
+        unsigned long long requests_started;
+        unsigned long long requests_finished;
+    };
+    static Stats stats(); // all threads together
+
 protected:
+    typedef unsigned RequestID;
+    struct Connection;
+    struct RequestInfo;
+
+    // Deadlines of one loop in a hierarchical timing wheel of 1 ms ticks.
+    // Each of its levels has 64 slots spanning 64 ticks of the level below,
+    // so arming and cancelling a timer is a list insertion or removal, and a
+    // timer moves down a level at most five times on its way to expiring.
+    // A bitmap of occupied slots per level finds the next thing to do
+    // without visiting the empty ones.
+    class TimerWheel {
+    public:
+        enum { levels = 6, slot_bits = 6, slots = 1 << slot_bits };
+
+        struct Link {
+            Link* prev;
+            Link* next;
+        };
+
+        struct Timer : Link {
+            enum Kind {
+                idle_deadline, read_deadline, request_deadline,
+                handler_deadline
+            };
+
+            Timer(Kind p_kind, Connection* p_connection,
+                  RequestInfo* p_request) :
+                wheel(0), kind(p_kind), connection(p_connection),
+                request(p_request) { prev = next = 0; }
+            ~Timer() { cancel(); }
+
+            bool armed() const { return next != 0; }
+            void cancel();
+
+            TimerWheel* wheel; // while armed
+            unsigned slot; // level * slots + index, or the expired list
+            unsigned long long expiry; // tick
+
+            Kind kind;
+            Connection* connection; // for idle and read
+            RequestInfo* request; // for request and handler
+        };
+
+        TimerWheel();
+
+        // the time arming counts from and expiring goes up to
+        void set_time(unsigned long long ns) { now_tick = ns / 1000000; }
+        void arm(Timer&, unsigned ms); // again if it is armed already
+        // to expire once now() has reached time, unless it is due sooner
+        void arm_by(Timer&, unsigned long long time);
+        // the next timer due by the time set, unlinked, or null
+        Timer* expire();
+        // ms from the time set until a timer is due or has to be moved down
+        // a level, -1 if there are none
+        int timeout() const;
+
+    private:
+        TimerWheel(const TimerWheel&);
+        TimerWheel& operator=(const TimerWheel&);
+
+        void insert(Timer&);
+        void link(Timer&, unsigned slot);
+        void cascade(unsigned level);
+        unsigned long long next_tick() const; // of the next step, ~0 if none
+
+        Link heads[levels * slots + 1]; // of the slots, the last of expired
+        unsigned long long occupied[levels];
+        unsigned long long current; // tick everything is due after
+        unsigned long long now_tick;
+    };
+    typedef TimerWheel::Timer Timer;
+
     struct RequestInfo : FastCGIRequest {
         RequestInfo();
 
+        void reset(); // for reuse, keeping buffer capacity
+
+        Connection* connection;
+        RequestID id;
         std::string params_buffer;
         bool params_closed;
-        bool in_closed;
         int status;
         bool output_closed;
+        bool output_started; // some of out has been queued to send
+
+        bool drain_waiting; // in its connection's drain_waiters
+
+        // from now(), 0 until they happen
+        unsigned long long begin_time;
+        unsigned long long params_time;
+        unsigned long long complete_time;
+
+        // set while a handle may complete the request, cleared when it has
+        std::shared_ptr<FastCGIDeferred::State> deferred;
+        bool completed;
+        bool handlers_done() const {
+            return status != 0 || deferred || completed;
+        }
+
+        // links in Connection's queue of requests with output to write
+        bool ready;
+        RequestInfo* ready_prev;
+        RequestInfo* ready_next;
+
+        Timer request_timer; // from FCGI_BEGIN_REQUEST, or to the deadline
+        Timer handler_timer; // from the end of the input
 
         friend class FastCGIServer;
     };
 
-    typedef unsigned RequestID;
-    typedef std::map<RequestID, RequestInfo*> RequestList;
+    // Received bytes waiting to be parsed.  Records are parsed where they
+    // lie and consumed by advancing an offset, so the only bytes ever moved
+    // are those of an incomplete record when the free space at the end runs
+    // out, and the socket is read straight into the buffer.
+    class InputBuffer {
+    public:
+        InputBuffer() : begin(0), end(0) {}
+
+        const char* data() const { return storage.data() + begin; }
+        std::string::size_type size() const { return end - begin; }
+        bool empty() const { return begin == end; }
+
+        void consume(std::string::size_type n) {
+            begin += n;
+            if (begin == end)
+                begin = end = 0;
+        }
+
+        // makes room for at least n more bytes, returns where they go and
+        // how many fit;  follow with commit() of the number actually written
+        char* prepare(std::string::size_type n,
+            std::string::size_type& available);
+        void commit(std::string::size_type n) { end += n; }
+
+    private:
+        std::vector<char> storage;
+        std::string::size_type begin;
+        std::string::size_type end;
+    };
+
+    // Bytes waiting to be sent.  Large payloads stay in the strings they were
+    // produced in and go out with a single sendmsg() next to small inline
+    // buffers holding record headers, padding and short records.  Pieces
+    // refer to buffers by offset, so inline buffers may grow until they are
+    // handed to gather().
+    class OutputQueue {
+    public:
+        struct Buffer {
+            Buffer() : pieces(0), file(-1), map(0) {}
+
+            std::string data;
+            unsigned pieces; // pieces still referring to data
+
+            // or a range of a file instead of data, which pieces refer to by
+            // file offset;  mapped into memory only if it has to be
+            int file;
+            std::string::size_type map_begin; // page aligned
+            std::string::size_type map_end;
+            void* map;
+        };
+
+        OutputQueue() : total(0), sent(0), open(false) {}
+        ~OutputQueue();
+
+        bool empty() const { return total == 0; }
+        std::string::size_type size() const { return total; }
+        unsigned long long consumed() const { return sent; } // ever
+
+        void append(const char* data, std::string::size_type n); // copies
+        void append(const std::string& data) {
+            append(data.data(), data.size());
+        }
+
+        // takes over the contents of payload and leaves it empty, though
+        // possibly with the capacity of an earlier payload
+        Buffer* adopt(std::string& payload);
+        Buffer* adopt_file(int file, std::string::size_type begin,
+            std::string::size_type end); // closes it when done
+        void append(Buffer* buffer, std::string::size_type begin,
+            std::string::size_type n);
+
+        // describes up to max pieces from the front, which must then stay
+        // put until they are consumed;  stops short of file pieces unless
+        // map_files, which maps them
+        int gather(struct iovec* iov, int max, bool map_files = false);
+        bool file_at(int piece) const {
+            return static_cast<std::deque<Piece>::size_type>(piece) <
+                pieces.size() && pieces[piece].buffer->file != -1;
+        }
+        // the file and range of the front piece, if it is one
+        bool front_file(int& file, off_t& offset,
+            std::string::size_type& n) const;
+        void consume(std::string::size_type n);
+
+    private:
+        struct Piece {
+            Buffer* buffer;
+            std::string::size_type begin;
+            std::string::size_type end;
+        };
+
+        void release_buffers();
+        static void release_file(Buffer&);
+
+        std::deque<Buffer> buffers;
+        std::deque<Piece> pieces;
+        std::vector<std::string> spare;
+        std::string::size_type total;
+        unsigned long long sent;
+        bool open; // buffers.back() accepts inline data
+    };
+
+    // Free RequestInfo objects of one thread, which is the same as one worker
+    // for FastCGIServer and FastCGIServerGroup.  Objects go back to the pool
+    // of whichever thread releases them.
+    class RequestPool {
+    public:
+        RequestPool();
+        ~RequestPool();
+
+        static RequestPool& local();
+
+        // pools of live threads, and what those of finished threads counted
+        static std::mutex& registry_mutex();
+        static std::vector<RequestPool*>& registry();
+        static PoolStats& retired();
+
+        RequestInfo* acquire();
+        void release(RequestInfo*);
+
+        // written by the owning thread only, read by pool_stats()
+        std::atomic<unsigned long long> hits;
+        std::atomic<unsigned long long> misses;
+        std::atomic<unsigned long long> cached;
+
+    private:
+        std::vector<RequestInfo*> free;
+    };
+
+    // Requests of one connection by ID.  IDs are 16 bits and web servers
+    // keep them low, so the first 256 are looked up directly and pages for
+    // the rest are only allocated when used.
+    class RequestTable {
+    public:
+        RequestTable();
+        ~RequestTable();
+
+        RequestInfo* find(RequestID id) const {
+            if (id < 0x100)
+                return low[id];
+            RequestInfo** page = high ? high[id >> 8] : 0;
+            return page ? page[id & 0xff] : 0;
+        }
+        void insert(RequestInfo*); // by its id, which must be free
+        void erase(RequestID id);
+        unsigned size() const { return count; }
+        // keeps total up to date as well
+        void count_in(std::atomic<unsigned>* p_total) { total = p_total; }
+
+        void release_all(); // to the thread's pool
+
+    private:
+        RequestTable(const RequestTable&);
+        RequestTable& operator=(const RequestTable&);
+
+        RequestInfo* low[0x100];
+        RequestInfo*** high;
+        unsigned count;
+        std::atomic<unsigned>* total;
+    };
+
+    // what is open on the server, against its limits
+    struct Load {
+        Load() : connections(0), requests(0) {}
+
+        std::atomic<unsigned> connections;
+        std::atomic<unsigned> requests;
+    };
+
     struct Connection {
         Connection();
+        ~Connection();
+
+        // requests wait here between producing output and having it framed,
+        // so a flush only visits requests that have something to say
+        void schedule(RequestInfo*);
+        void unschedule(RequestInfo*);
+        bool has_output() const { return ready_first || !output_buffer.empty(); }
+        // nothing left to send now or later, the socket may be closed
+        bool drained() const { return !has_output() && deferred_requests == 0; }
 
-        RequestList requests;
-        std::string input_buffer;
-        std::string output_buffer;
+        int read_socket; // -1 if the descriptor isn't ours to manage
+        RequestTable requests;
+        RequestInfo* ready_first;
+        RequestInfo* ready_last;
+        InputBuffer input_buffer;
+        OutputQueue output_buffer;
         bool close_responsibility;
         bool close_socket;
+        bool reset; // peer went away, drop the connection right now
+        unsigned events; // registered with the poller
+        // parsing waits for the blocked request to consume its input, and
+        // the socket isn't read meanwhile
+        bool paused;
+        RequestInfo* blocked; // null once it has gone away
+        std::string::size_type output_watermark;
+        std::vector<RequestInfo*> drain_waiters;
+        std::shared_ptr<FastCGIDeferred::Completer> completer;
+        unsigned deferred_requests; // waiting for their handles
+        Load* load; // of the server that admitted it
+
+        Timer idle_timer;
+        Timer read_timer; // armed while part of a record is waiting
+
+        // for Stats, cleared once the first request has begun
+        unsigned long long accept_time;
+        // where in the output ended requests end, with when their input did
+        struct FlushMark {
+            unsigned long long position;
+            unsigned long long complete_time;
+        };
+        std::deque<FlushMark> flush_marks;
+    };
+
+    // Stats of one thread, kept like RequestPool
+    class ThreadStats {
+    public:
+        ThreadStats();
+        ~ThreadStats();
+
+        static ThreadStats& local();
+
+        static std::mutex& registry_mutex();
+        static std::vector<ThreadStats*>& registry();
+        static Stats& retired();
+
+        void record(Stats::Stage, unsigned long long duration);
+        void add_to(Stats&) const;
+
+        // written by the owning thread only, read by stats()
+        std::atomic<unsigned long long>
+            latency[Stats::stage_count][FastCGIHistogram::buckets];
+        std::atomic<unsigned long long> latency_sum[Stats::stage_count];
+        std::atomic<unsigned long long> records;
+        std::atomic<unsigned long long> bytes_received;
+        std::atomic<unsigned long long> bytes_sent;
+        std::atomic<unsigned long long> partial_writes;
+        std::atomic<unsigned long long> aborts;
+        std::atomic<unsigned long long> timeouts;
+        std::atomic<unsigned long long> expired;
+        std::atomic<unsigned long long> shed;
+        std::atomic<unsigned long long> connections_refused;
+        std::atomic<unsigned long long> requests_refused;
+        std::atomic<unsigned long long> connections_opened;
+        std::atomic<unsigned long long> connections_closed;
+        std::atomic<unsigned long long> requests_started;
+        std::atomic<unsigned long long> requests_finished;
+    };
+
+    static unsigned long long now(); // monotonic nanoseconds
+
+    // The overload_target() state of one server, fed by its loop and by the
+    // handler pool's threads.  Whoever sees an interval over first judges
+    // it by the shortest wait in it, as CoDel does.
+    class OverloadControl {
+    public:
+        OverloadControl();
+
+        void configure(unsigned long long target, unsigned long long interval);
+        // records how long a request waited, and tells whether to shed it
+        bool shed(unsigned long long waited, unsigned long long time);
+        bool overloaded() const {
+            return state.load(std::memory_order_relaxed);
+        }
+
+    private:
+        unsigned long long target; // ns, 0 is off
+        unsigned long long interval;
+        std::atomic<unsigned long long> interval_end;
+        std::atomic<unsigned long long> least; // wait so far, ~0 if none
+        std::atomic<bool> state;
+    };
+
+    // Completed deferred requests on their way back to the loop, which is
+    // woken up through an eventfd, or a pipe where there is none.  A
+    // lock-free stack linked through the states themselves, which the loop
+    // takes all at once.  Only the post that finds it empty signals the
+    // descriptor, so a burst of completions costs the loop one wakeup and
+    // the workers one write between them.
+    class CompletionQueue : public FastCGIDeferred::Completer {
+    public:
+        CompletionQueue();
+        ~CompletionQueue();
+
+        void post(const std::shared_ptr<FastCGIDeferred::State>&);
+        void shutdown(); // posts from now on are dropped
+
+        int descriptor() const { return read_fd; }
+        // clears the wakeup and moves out everything posted so far, oldest
+        // first
+        void take(std::vector<std::shared_ptr<FastCGIDeferred::State> >&);
+
+    private:
+        FastCGIDeferred::State* detach(); // the whole stack, newest first
+        void discard(FastCGIDeferred::State*);
+
+        std::atomic<FastCGIDeferred::State*> head;
+        int read_fd;
+        int write_fd; // the same as read_fd for an eventfd
+        std::atomic<bool> closed;
     };
 
     typedef std::map<std::string, std::string> Pairs;
@@ -114,16 +999,99 @@ protected:
     std::vector<int> listen_sockets;
     std::vector<std::string> listen_unlink;
 
-    std::map<int, Connection*> read_sockets;
+    // indexed by socket descriptor, null for descriptors we don't own
+    std::vector<Connection*> connections;
+
+    FastCGIPoller* poller;
+    std::vector<FastCGIPoller::Event> ready_events;
+    // when the wait of the current round of the loop returned;  0 where
+    // there are no rounds, see shed()
+    unsigned long long round_time;
+    bool build_params_map;
+    int listen_queue;
+    unsigned accept_limit;
+    std::string::size_type request_input_limit;
+    std::string::size_type output_limit;
+    unsigned idle_limit;
+    unsigned read_limit;
+    unsigned request_limit;
+    unsigned handler_limit;
+    TimerWheel timers;
+    std::string deadline_name;
+    unsigned deadline_default;
+    std::string no_bid;
+    OverloadControl overload;
+    std::string overload_text;
+    // the whole answer, framed for request ID 0 and patched for each one
+    std::string overload_records;
+    unsigned connection_max;
+    unsigned request_max;
+    bool multiplexing;
+    // servers sharing the listening sockets, which the advertised limits
+    // are for
+    unsigned workers;
+    Load load;
+    // listening sockets that ran out of budget with connections left over;
+    // an edge-triggered poller won't report them again
+    std::vector<int> pending_accepts;
+    std::shared_ptr<CompletionQueue> completions; // from the first connection
+    std::vector<std::shared_ptr<FastCGIDeferred::State> > completed;
+    std::string stats_path;
+
+    void add_listen_socket(int listen_socket);
+    void accept_connections(int listen_socket);
+    // counts it against max_connections(), false if it is one too many
+    bool admit(Connection&);
+    void read_connection(int read_socket, Connection&);
+    void write_connection(int read_socket, Connection&);
+    void close_connection(int read_socket);
+    void flush_connection(int read_socket, Connection&);
+    bool input_caught_up(const Connection&) const; // may be unpaused
+    void process_completions();
+    // milliseconds to wait, with the time until the next timer
+    int wait_timeout(int timeout_ms);
+    void update_timers(Connection&); // after a flush
+    // runs the timers that are due and collects the descriptors of the
+    // connections they affected, each once
+    void expire_timers(std::vector<int>& flush);
+    // before its handlers did, with the no-bid response or status 1
+    void end_request(RequestInfo&, bool expired);
+    void set_deadline(RequestInfo&);
+    bool past_deadline(RequestInfo&); // and answered with the no-bid response
+    bool shed(RequestInfo&); // and answered with the overload response
+    // answers FCGI_BEGIN_REQUEST with FCGI_END_REQUEST and the status
+    void refuse_request(Connection&, RequestID, unsigned char status);
+
+    // runs what a handle has posted on the thread owning its request,
+    // returns the request's connection for flushing, or null if the request
+    // has gone away
+    static Connection* resume_deferred(FastCGIDeferred::State&);
+    static void complete_deferred(FastCGIDeferred::State&);
+    static void continue_request(RequestInfo&); // after new input
+    static void take_completion(RequestInfo&); // if completed already
+
+    bool stats_request(const RequestInfo&) const;
+    void render_stats(std::string& out) const;
+
+    // the complete handler, or a pool task that runs it
+    class PooledRequest;
+    int complete_request(RequestInfo&);
 
     void process_connection_read(Connection&);
-    static void process_write_request(Connection&, RequestID, RequestInfo&);
-    static void process_connection_write(Connection&);
+    static void process_write_request(Connection&, RequestInfo&);
+    static void write_streams(Connection&, RequestInfo&); // what there is
+    // consumes n of the offered bytes after a write
+    static void sent(Connection&, std::string::size_type n,
+        std::string::size_type offered);
+    static bool wake_drained(Connection&); // true if anyone was waiting
+    static void process_connection_write(Connection&); // the ready ones
     static Pairs parse_pairs(const char*, std::string::size_type);
     static void write_pair(std::string& buffer,
         const std::string& key, const std::string&);
-    static void write_data(std::string& buffer, RequestID id,
-        const std::string& input, unsigned char type);
+    static void write_data(OutputQueue& buffer, RequestID id,
+        std::string& input, unsigned char type); // empties input
+    static void write_file(OutputQueue& buffer, RequestID id, int file,
+        off_t offset, std::string::size_type length);
 
 
     struct HandlerBase {
@@ -154,10 +1122,93 @@ protected:
     };
 
     void set_handler(HandlerBase*&, HandlerBase*);
+    static int run_handler(HandlerBase*, FastCGIRequest&); // timed
 
     HandlerBase* handle_request;
     HandlerBase* handle_data;
     HandlerBase* handle_complete;
+    FastCGIHandlerPool* complete_pool;
+
+    // tasks on complete_pool that refer back to the server, which waits
+    // for them before it goes away
+    unsigned pooled;
+    std::mutex pooled_mutex;
+    std::condition_variable pooled_done;
+
+    friend class FastCGIServerGroup;
+    friend class FastCGIWriter;
+};
+
+
+// Runs several independent FastCGIServer loops, one per thread.  Every worker
+// has its own listening socket, connection table and copy of the handlers, so
+// nothing is shared on the request path;  with SO_REUSEPORT the kernel spreads
+// TCP connections across the workers, a local socket is shared by all of them.
+// Handlers are called concurrently from all worker threads.
+class FastCGIServerGroup {
+public:
+    explicit FastCGIServerGroup(unsigned workers = 0); // 0 is one per CPU
+    ~FastCGIServerGroup();
+
+    void request_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void request_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+                it != servers.end(); ++it)
+            (*it)->request_handler(object, function);
+    }
+
+    void data_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void data_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+                it != servers.end(); ++it)
+            (*it)->data_handler(object, function);
+    }
+
+    void complete_handler(int (* function)(FastCGIRequest&));
+    template<class C>
+    void complete_handler(C& object, int (C::* function)(FastCGIRequest&)) {
+        for (std::vector<FastCGIServer*>::iterator it = servers.begin();
+                it != servers.end(); ++it)
+            (*it)->complete_handler(object, function);
+    }
+
+    void params_map(bool enabled);
+    void input_limit(std::string::size_type bytes);
+    void output_watermark(std::string::size_type bytes);
+    void listen_backlog(int backlog);
+    void accept_budget(unsigned budget);
+    void idle_timeout(unsigned ms);
+    void read_timeout(unsigned ms);
+    void request_timeout(unsigned ms);
+    void handler_timeout(unsigned ms);
+    void deadline_param(const std::string& name, unsigned default_ms = 0);
+    void no_bid_response(const std::string& response);
+    void overload_target(unsigned target_ms, unsigned interval_ms = 100);
+    void overload_response(const std::string& response);
+    // per worker, and advertised for all of them together
+    void max_connections(unsigned connections);
+    void max_requests(unsigned requests);
+    void multiplex(bool enabled);
+    void handler_pool(FastCGIHandlerPool* pool); // may be shared
+    void stats_route(const std::string& path);
+    void listen(unsigned tcp_port);
+    void listen(const std::string& local_path);
+    void abandon_files();
+
+    // runs the first worker on the calling thread and the others on threads
+    // of their own;  does not return unless a worker throws, and then stops
+    // and joins all the others before rethrowing its exception
+    void process_forever();
+
+    unsigned size() const { return servers.size(); }
+    FastCGIServer& worker(unsigned i) { return *servers[i]; }
+
+protected:
+    std::vector<FastCGIServer*> servers;
+
+    void share_listen_socket(); // the first worker's newest listener
 };
 
 #endif // !FCGICC_H
@@ -0,0 +1,292 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ */
+
+
+#include "fcgicc_asio.h"
+
+#include <algorithm> // max
+#include <array>
+#include <chrono>
+
+#include <unistd.h> // unlink
+
+
+// One FastCGI connection.  Reads and writes are separate chains of
+// completion handlers, each with at most one operation in flight, and both
+// run on the session's strand so the Connection is never touched
+// concurrently.
+template<class Protocol>
+class AsioFastCGIServer::Session :
+        public std::enable_shared_from_this<Session<Protocol> > {
+public:
+    Session(AsioFastCGIServer& p_server, typename Protocol::socket p_socket) :
+        server(p_server),
+        socket(std::move(p_socket)),
+        strand(p_server.io_context),
+        reading_active(false),
+        writing_active(false)
+    {
+    }
+
+    void start()
+    {
+        if (!server.admit(connection)) {
+            std::error_code ignored;
+            socket.close(ignored);
+            return;
+        }
+        connection.completer = std::make_shared<SessionCompleter>(
+            this->shared_from_this());
+        connection.output_watermark = server.output_limit;
+        read();
+    }
+
+private:
+    // doesn't keep the session alive, its requests refer to it
+    struct SessionCompleter : FastCGIDeferred::Completer {
+        explicit SessionCompleter(const std::shared_ptr<Session>& p_session) :
+            session(p_session) {}
+
+        void post(const std::shared_ptr<FastCGIDeferred::State>& state)
+        {
+            std::shared_ptr<Session> self(session.lock());
+            if (self)
+                self->strand.post(alloc_handler(self->completion_memory,
+                    [self, state] {
+                        if (resume_deferred(*state))
+                            self->flush();
+                    }));
+        }
+
+        std::weak_ptr<Session> session;
+    };
+
+    void read()
+    {
+        std::string::size_type available;
+        char* buffer = connection.input_buffer.prepare(16384, available);
+
+        reading_active = true;
+        std::shared_ptr<Session> self(this->shared_from_this());
+        socket.async_read_some(asio::buffer(buffer, available), strand.wrap(
+            alloc_handler(read_memory,
+                [this, self](const std::error_code& error, std::size_t n) {
+                    reading_active = false;
+                    if (error) {
+                        if (error != asio::error::eof) {
+                            close();
+                            return;
+                        }
+                        connection.close_socket = true;
+                    } else {
+                        connection.input_buffer.commit(n);
+                        server.process_connection_read(connection);
+                    }
+
+                    flush();
+                    if (connection.close_socket || reading_active)
+                        ;
+                    else if (connection.paused)
+                        lingering = self; // there is no read to do that
+                    else
+                        read();
+                })));
+    }
+
+    // carries on reading once the request that paused it has caught up
+    void unpause()
+    {
+        if (!connection.paused || !server.input_caught_up(connection))
+            return;
+        connection.paused = false;
+        server.process_connection_read(connection);
+        if (!connection.close_socket && !connection.paused &&
+                !reading_active) {
+            read();
+            lingering.reset();
+        }
+    }
+
+    void flush()
+    {
+        if (writing_active)
+            return;
+
+        unpause();
+        wake_drained(connection);
+        process_connection_write(connection);
+
+        if (connection.output_buffer.empty()) {
+            if (connection.close_socket) {
+                // no more reads to keep the session alive, so hold on to it
+                // until the deferred requests have been answered
+                std::shared_ptr<Session> self(this->shared_from_this());
+                if (connection.drained())
+                    close();
+                else
+                    lingering = self;
+            }
+            return;
+        }
+
+        struct iovec iov[64];
+        int count = connection.output_buffer.gather(iov, 64, true);
+        std::size_t offered = 0;
+        for (int i = 0; i < count; i++) {
+            gathered[i] = asio::const_buffer(iov[i].iov_base, iov[i].iov_len);
+            offered += iov[i].iov_len;
+        }
+        writing_active = true;
+
+        std::shared_ptr<Session> self(this->shared_from_this());
+        socket.async_write_some(
+            GatheredBuffers(gathered.data(), gathered.data() + count),
+            strand.wrap(alloc_handler(write_memory,
+                [this, self, offered](const std::error_code& error,
+                        std::size_t n) {
+                    writing_active = false;
+                    if (error)
+                        close();
+                    else {
+                        sent(connection, n, offered);
+                        flush();
+                    }
+                })));
+    }
+
+    // the caller holds on to the session, which goes away once it is done
+    void close()
+    {
+        std::error_code ignored;
+        socket.shutdown(Protocol::socket::shutdown_both, ignored);
+        socket.close(ignored);
+        lingering.reset();
+    }
+
+    AsioFastCGIServer& server;
+    typename Protocol::socket socket;
+    asio::io_context::strand strand;
+
+    // operations keep a copy of their buffer sequence, so give them a view
+    // of the gathered pieces rather than a container
+    struct GatheredBuffers {
+        typedef asio::const_buffer value_type;
+        typedef const asio::const_buffer* const_iterator;
+
+        GatheredBuffers(const_iterator p_first, const_iterator p_last) :
+            first(p_first), last(p_last) {}
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+
+        const_iterator first;
+        const_iterator last;
+    };
+
+    Connection connection;
+    std::array<asio::const_buffer, 64> gathered;
+    bool reading_active;
+    bool writing_active;
+    std::shared_ptr<Session> lingering;
+
+    HandlerMemory read_memory;
+    HandlerMemory write_memory;
+    HandlerMemory completion_memory; // posted from any thread
+};
+
+
+AsioFastCGIServer::AsioFastCGIServer(unsigned p_threads) :
+    threads(p_threads ? p_threads :
+        std::max(std::thread::hardware_concurrency(), 1u))
+{
+}
+
+
+AsioFastCGIServer::~AsioFastCGIServer()
+{
+}
+
+
+void
+AsioFastCGIServer::listen(unsigned tcp_port)
+{
+    tcp_acceptors.push_back(std::unique_ptr<Acceptor<asio::ip::tcp> >(
+        new Acceptor<asio::ip::tcp>(io_context,
+            asio::ip::tcp::endpoint(asio::ip::tcp::v4(), tcp_port),
+            listen_queue)));
+    accept(*tcp_acceptors.back());
+}
+
+
+void
+AsioFastCGIServer::listen(const std::string& local_path)
+{
+    unlink(local_path.c_str());
+    local_acceptors.push_back(
+        std::unique_ptr<Acceptor<asio::local::stream_protocol> >(
+            new Acceptor<asio::local::stream_protocol>(io_context,
+                asio::local::stream_protocol::endpoint(local_path),
+                listen_queue)));
+    listen_unlink.push_back(local_path);
+    accept(*local_acceptors.back());
+}
+
+
+template<class Protocol>
+void
+AsioFastCGIServer::accept(Acceptor<Protocol>& acceptor)
+{
+    acceptor.acceptor.async_accept(alloc_handler(acceptor.memory,
+        [this, &acceptor](const std::error_code& error,
+                          typename Protocol::socket socket) {
+            if (error == asio::error::operation_aborted)
+                return;
+            if (error && error != asio::error::connection_aborted) {
+                // out of descriptors or buffers, which accepting again
+                // straight away would only spin on, so wait for some to be
+                // freed
+                acceptor.retry.expires_after(std::chrono::milliseconds(100));
+                acceptor.retry.async_wait(alloc_handler(acceptor.memory,
+                    [this, &acceptor](const std::error_code& error) {
+                        if (!error)
+                            accept(acceptor);
+                    }));
+                return;
+            }
+            if (!error)
+                std::make_shared<Session<Protocol> >(*this,
+                    std::move(socket))->start();
+            accept(acceptor);
+        }));
+}
+
+
+void
+AsioFastCGIServer::run()
+{
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.push_back(std::thread([this] { io_context.run(); }));
+
+    try {
+        io_context.run();
+    } catch (...) {
+        io_context.stop();
+        for (std::vector<std::thread>::iterator it = pool.begin();
+                it != pool.end(); ++it)
+            it->join();
+        throw;
+    }
+
+    for (std::vector<std::thread>::iterator it = pool.begin();
+            it != pool.end(); ++it)
+        it->join();
+}
+
+
+void
+AsioFastCGIServer::stop()
+{
+    io_context.stop();
+}
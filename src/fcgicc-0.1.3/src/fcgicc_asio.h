@@ -0,0 +1,156 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * FastCGI server running on an asio io_context instead of its own loop.
+ */
+
+
+#ifndef FCGICC_ASIO_H
+#define FCGICC_ASIO_H
+
+#include "fcgicc.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#include <asio.hpp>
+
+
+// Same protocol handling as FastCGIServer, but sockets are driven by
+// asynchronous operations on an asio::io_context, so FastCGI connections can
+// share a thread pool with the application's own asynchronous calls.
+// Handlers are called concurrently from all threads running the context.
+class AsioFastCGIServer : protected FastCGIServer {
+public:
+    explicit AsioFastCGIServer(unsigned threads = 0); // 0 is one per CPU
+    ~AsioFastCGIServer();
+
+    using FastCGIServer::request_handler;
+    using FastCGIServer::data_handler;
+    using FastCGIServer::complete_handler;
+    using FastCGIServer::params_map;
+    using FastCGIServer::input_limit;
+    using FastCGIServer::output_watermark;
+    using FastCGIServer::handler_pool;
+    using FastCGIServer::pool_stats;
+    using FastCGIServer::stats;
+    using FastCGIServer::stats_route;
+    // the context has no rounds to measure from, so without a handler pool
+    // a request is seen to wait only behind those before it on its own
+    // connection
+    using FastCGIServer::overload_target;
+    using FastCGIServer::overload_response;
+    using FastCGIServer::max_connections;
+    using FastCGIServer::max_requests;
+    using FastCGIServer::multiplex;
+    using FastCGIServer::defer; // completions go through the session's strand
+
+    using FastCGIServer::listen_backlog;
+    void listen(unsigned tcp_port);
+    void listen(const std::string& local_path);
+    using FastCGIServer::abandon_files;
+
+    // runs the io_context on the calling thread and threads - 1 others,
+    // returns once it is stopped
+    void run();
+    void stop();
+
+    asio::io_context& context() { return io_context; }
+
+protected:
+    // A single block of memory for the one asynchronous operation a chain of
+    // completion handlers has outstanding at any time, so that steady state
+    // reads, writes and deferred completions don't allocate.  Falls back to
+    // the heap if it is busy or too small.  Completions are posted from any
+    // thread, so it is claimed atomically.
+    class HandlerMemory {
+    public:
+        HandlerMemory() : in_use(false) {}
+        HandlerMemory(const HandlerMemory&) = delete;
+        HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+        void* allocate(std::size_t size) {
+            if (size <= sizeof(storage) &&
+                    !in_use.exchange(true, std::memory_order_acquire))
+                return &storage;
+            return ::operator new(size);
+        }
+
+        void deallocate(void* pointer) {
+            if (pointer == &storage)
+                in_use.store(false, std::memory_order_release);
+            else
+                ::operator delete(pointer);
+        }
+
+    private:
+        std::aligned_storage<1024>::type storage;
+        std::atomic<bool> in_use;
+    };
+
+    template<class Handler>
+    struct AllocHandler {
+        AllocHandler(HandlerMemory& p_memory, Handler p_handler) :
+            memory(p_memory), handler(std::move(p_handler)) {}
+
+        template<class... Args>
+        void operator()(Args&&... args) {
+            handler(std::forward<Args>(args)...);
+        }
+
+        friend void* asio_handler_allocate(std::size_t size,
+                AllocHandler* this_handler) {
+            return this_handler->memory.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void* pointer, std::size_t,
+                AllocHandler* this_handler) {
+            this_handler->memory.deallocate(pointer);
+        }
+
+        HandlerMemory& memory;
+        Handler handler;
+    };
+
+    template<class Handler>
+    static AllocHandler<Handler> alloc_handler(HandlerMemory& memory,
+            Handler handler) {
+        return AllocHandler<Handler>(memory, std::move(handler));
+    }
+
+    template<class Protocol>
+    class Session;
+
+    template<class Protocol>
+    struct Acceptor {
+        Acceptor(asio::io_context& io_context,
+                 const typename Protocol::endpoint& endpoint, int backlog) :
+            acceptor(io_context), retry(io_context)
+        {
+            acceptor.open(endpoint.protocol());
+            acceptor.set_option(
+                typename Protocol::acceptor::reuse_address(true));
+            acceptor.bind(endpoint);
+            acceptor.listen(backlog);
+        }
+
+        typename Protocol::acceptor acceptor;
+        asio::steady_timer retry; // after running out of descriptors
+        HandlerMemory memory;
+    };
+
+    template<class Protocol>
+    void accept(Acceptor<Protocol>&);
+
+    unsigned threads;
+    asio::io_context io_context;
+    std::vector<std::unique_ptr<Acceptor<asio::ip::tcp> > > tcp_acceptors;
+    std::vector<std::unique_ptr<Acceptor<asio::local::stream_protocol> > >
+        local_acceptors;
+};
+
+#endif // !FCGICC_ASIO_H
@@ -0,0 +1,309 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * Request handlers written as C++20 coroutines.
+ */
+
+
+#ifndef FCGICC_CORO_H
+#define FCGICC_CORO_H
+
+#include "fcgicc.h"
+
+#ifndef __cpp_impl_coroutine
+#error "fcgicc_coro.h needs a compiler with C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <new>
+#include <utility>
+
+
+// Coroutine frames of one thread, which is one worker, recycled by size in
+// steps of 128 bytes up to 4 KB.  A worker keeps running the same few
+// handlers, so once it has warmed up their frames come from here.
+class FastCGIFramePool {
+public:
+    static void* allocate(std::size_t size) {
+        unsigned size_class = (size + granularity - 1) / granularity;
+        if (size_class >= classes)
+            return ::operator new(size);
+
+        Lists& lists = local();
+        if (Block* block = lists.free[size_class]) {
+            lists.free[size_class] = block->next;
+            --lists.count[size_class];
+            return block;
+        }
+        return ::operator new(size_class * granularity);
+    }
+
+    static void deallocate(void* pointer, std::size_t size) noexcept {
+        unsigned size_class = (size + granularity - 1) / granularity;
+        if (size_class >= classes) {
+            ::operator delete(pointer);
+            return;
+        }
+
+        Lists& lists = local();
+        if (lists.count[size_class] == max_cached) {
+            ::operator delete(pointer);
+            return;
+        }
+        Block* block = static_cast<Block*>(pointer);
+        block->next = lists.free[size_class];
+        lists.free[size_class] = block;
+        ++lists.count[size_class];
+    }
+
+private:
+    enum { granularity = 128, classes = 33, max_cached = 1024 };
+
+    struct Block {
+        Block* next;
+    };
+
+    struct Lists {
+        Lists() {
+            for (unsigned i = 0; i < classes; i++) {
+                free[i] = 0;
+                count[i] = 0;
+            }
+        }
+        ~Lists() {
+            for (unsigned i = 0; i < classes; i++)
+                while (Block* block = free[i]) {
+                    free[i] = block->next;
+                    ::operator delete(block);
+                }
+        }
+
+        Block* free[classes];
+        unsigned count[classes];
+    };
+
+    static Lists& local() {
+        thread_local Lists lists;
+        return lists;
+    }
+};
+
+
+// Return type of a coroutine handler, which co_returns the application
+// status.  It runs on the thread owning the request, which it shares with
+// the other requests of the worker, so it should co_await rather than block.
+class FastCGITask {
+public:
+    struct promise_type {
+        enum Waiting { nothing, input, wakeup, drain };
+
+        promise_type() : status(0), waiting(nothing) {}
+
+        FastCGITask get_return_object() {
+            return FastCGITask(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_value(int p_status) { status = p_status; }
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        static void* operator new(std::size_t size) {
+            return FastCGIFramePool::allocate(size);
+        }
+        static void operator delete(void* pointer, std::size_t size) {
+            FastCGIFramePool::deallocate(pointer, size);
+        }
+
+        int status;
+        Waiting waiting;
+        std::exception_ptr exception;
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    FastCGITask(FastCGITask&& other) :
+        handle(std::exchange(other.handle, Handle())) {}
+    ~FastCGITask() {
+        if (handle)
+            handle.destroy();
+    }
+
+    Handle release() { return std::exchange(handle, Handle()); }
+
+private:
+    explicit FastCGITask(Handle p_handle) : handle(p_handle) {}
+
+    Handle handle;
+};
+
+
+// Waits until there is something in request.in or the standard input has
+// been closed, and yields whether there is anything to process:
+//
+//     while (co_await FastCGIInput(request)) {
+//         consume(request.in);
+//         request.in.clear();
+//     }
+class FastCGIInput {
+public:
+    explicit FastCGIInput(FastCGIRequest& p_request) : request(p_request) {}
+
+    bool await_ready() const {
+        return !request.in.empty() || request.in_closed;
+    }
+    void await_suspend(FastCGITask::Handle handle) {
+        handle.promise().waiting = FastCGITask::promise_type::input;
+    }
+    bool await_resume() const { return !request.in.empty(); }
+
+private:
+    FastCGIRequest& request;
+};
+
+
+// Waits for something asynchronous, such as a call to another service.  The
+// start function is given the request's FastCGIDeferred handle and should
+// arrange for wake() to be called on it once the result is in, from any
+// thread;  the coroutine then carries on where the request lives:
+//
+//     co_await FastCGIWakeup(request, [&](FastCGIDeferred handle) {
+//         cache.get(key, [&, handle](const Value& v) mutable {
+//             value = v;
+//             handle.wake();
+//         });
+//     });
+template<class Start>
+class FastCGIWakeup {
+public:
+    FastCGIWakeup(FastCGIRequest& p_request, Start p_start) :
+        request(p_request), start(std::move(p_start)) {}
+
+    bool await_ready() const { return false; }
+    void await_suspend(FastCGITask::Handle handle) {
+        handle.promise().waiting = FastCGITask::promise_type::wakeup;
+        start(FastCGIServer::defer(request));
+    }
+    void await_resume() const {}
+
+private:
+    FastCGIRequest& request;
+    Start start;
+};
+
+
+// Waits until the connection has sent enough of its queued output for the
+// writer to be worth using again:
+//
+//     FastCGIWriter writer(request);
+//     while (more_rows()) {
+//         writer.write(next_row());
+//         if (writer.full())
+//             co_await FastCGIDrain(writer);
+//     }
+class FastCGIDrain {
+public:
+    explicit FastCGIDrain(FastCGIWriter& p_writer) : writer(p_writer) {}
+
+    bool await_ready() const { return false; }
+    bool await_suspend(FastCGITask::Handle handle) {
+        if (!writer.wait_drained())
+            return false;
+        handle.promise().waiting = FastCGITask::promise_type::drain;
+        return true;
+    }
+    void await_resume() const {}
+
+private:
+    FastCGIWriter& writer;
+};
+
+
+// Installs a coroutine as the request handler of a FastCGIServer,
+// FastCGIServerGroup or AsioFastCGIServer.  The coroutine is started once
+// the parameters are in and replaces the data and complete handlers:  it
+// reads the standard input with FastCGIInput and may write to request.out
+// at any point, which is sent whenever it suspends, or stream a large
+// response with FastCGIWriter and FastCGIDrain.  The request ends when it
+// returns.  Must outlive the server.
+class FastCGICoroutineHandler {
+public:
+    typedef std::function<FastCGITask (FastCGIRequest&)> Function;
+
+    explicit FastCGICoroutineHandler(Function p_function) :
+        function(std::move(p_function)) {}
+
+    template<class Server>
+    void install(Server& server) {
+        server.request_handler(*this, &FastCGICoroutineHandler::start);
+    }
+
+    int start(FastCGIRequest& request) {
+        FastCGITask task(function(request));
+        Frame* frame = new Frame(task.release(), FastCGIServer::defer(request));
+        request.continuation.reset(frame);
+        frame->resume();
+        return 0;
+    }
+
+private:
+    class Frame : public FastCGIRequest::Continuation {
+    public:
+        Frame(FastCGITask::Handle p_handle, FastCGIDeferred p_response) :
+            handle(p_handle), response(p_response) {}
+        ~Frame() { handle.destroy(); }
+
+        void input(FastCGIRequest&) {
+            if (handle.promise().waiting == FastCGITask::promise_type::input)
+                resume();
+        }
+        void wake(FastCGIRequest&) {
+            if (handle.promise().waiting == FastCGITask::promise_type::wakeup)
+                resume();
+        }
+        void drained(FastCGIRequest&) {
+            if (handle.promise().waiting == FastCGITask::promise_type::drain)
+                resume();
+        }
+
+        void resume() {
+            FastCGITask::promise_type& promise = handle.promise();
+            promise.waiting = FastCGITask::promise_type::nothing;
+            handle.resume();
+            if (!handle.done())
+                return;
+            if (promise.exception) {
+                // thrown out of process() it would stop the loop and leave
+                // the request hanging, so tell the web server instead
+                try {
+                    std::rethrow_exception(promise.exception);
+                } catch (const std::exception& e) {
+                    response.err().append(e.what());
+                } catch (...) {
+                }
+                response.complete(1);
+                return;
+            }
+            response.complete(promise.status);
+        }
+
+        static void* operator new(std::size_t size) {
+            return FastCGIFramePool::allocate(size);
+        }
+        static void operator delete(void* pointer, std::size_t size) {
+            FastCGIFramePool::deallocate(pointer, size);
+        }
+
+    private:
+        FastCGITask::Handle handle;
+        FastCGIDeferred response;
+    };
+
+    Function function;
+};
+
+#endif // !FCGICC_CORO_H
@@ -0,0 +1,634 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ */
+
+
+#include "fcgicc_uring.h"
+
+#include <algorithm> // max
+#include <cstring> // bzero, memcpy
+#include <stdexcept>
+
+#include <errno.h> // E*
+#include <fcntl.h> // fcntl, F_*, O_NONBLOCK
+#include <poll.h> // POLLIN
+#include <unistd.h> // close, syscall
+#include <sys/mman.h> // mmap, munmap
+#include <sys/syscall.h> // __NR_io_uring_*
+
+
+// received data is copied out of these into the connection's input buffer,
+// which is where records are parsed, and the buffer goes straight back
+static const unsigned receive_buffer_size = 16384;
+
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+static int
+io_uring_register(int fd, unsigned opcode, void* arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+
+static void*
+map_anonymous(std::size_t size)
+{
+    void* memory = mmap(0, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::runtime_error("mmap() failed");
+    return memory;
+}
+
+
+IoUringFastCGIServer::IoUringFastCGIServer(unsigned entries,
+                                           unsigned buffers) :
+    ring_fd(-1),
+    sq_local_tail(0),
+    sq_submitted(0),
+    rings(MAP_FAILED),
+    rings_size(0),
+    sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+    sqes_size(0),
+    ring_enabled(false),
+    buffer_ring(static_cast<struct io_uring_buf_ring*>(MAP_FAILED)),
+    buffer_ring_size(0),
+    buffer_memory(static_cast<char*>(MAP_FAILED)),
+    buffer_count(1),
+    buffer_tail(0),
+    wakeup_armed(false),
+    enter_calls(0)
+{
+    try {
+        // the ring belongs to whichever thread runs the loop, which may not
+        // be this one, so it starts disabled and process() enables it
+        struct io_uring_params params;
+        bzero(&params, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+            IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+            IORING_SETUP_R_DISABLED;
+        params.cq_entries = entries * 4; // a round may finish lots at once
+        ring_fd = io_uring_setup(entries, &params);
+        if (ring_fd == -1 && errno == EINVAL) {
+            // before Linux 6.1
+            bzero(&params, sizeof(params));
+            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+                IORING_SETUP_COOP_TASKRUN;
+            params.cq_entries = entries * 4;
+            ring_fd = io_uring_setup(entries, &params);
+        }
+        if (ring_fd == -1)
+            throw std::runtime_error("io_uring_setup() failed");
+        ring_enabled = !(params.flags & IORING_SETUP_R_DISABLED);
+
+        unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+            IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required)
+            throw std::runtime_error("io_uring is too old");
+
+        rings_size = std::max<std::size_t>(
+            params.sq_off.array + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes +
+                params.cq_entries * sizeof(struct io_uring_cqe));
+        rings = mmap(0, rings_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (rings == MAP_FAILED)
+            throw std::runtime_error("mmap() failed");
+        sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(mmap(0, sqes_size,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+            IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            throw std::runtime_error("mmap() failed");
+
+        char* base = static_cast<char*>(rings);
+        sq_entries = params.sq_entries;
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        // entries are used in order, so the indirection is always the same
+        unsigned* array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; i++)
+            array[i] = i;
+        sq_local_tail = sq_submitted = *sq_tail;
+        cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+        while (buffer_count < buffers && buffer_count < 0x8000)
+            buffer_count *= 2;
+        buffer_ring_size = buffer_count * sizeof(struct io_uring_buf);
+        buffer_ring = static_cast<struct io_uring_buf_ring*>(
+            map_anonymous(buffer_ring_size));
+        buffer_memory = static_cast<char*>(
+            map_anonymous(buffer_count * receive_buffer_size));
+
+        struct io_uring_buf_reg registration;
+        bzero(&registration, sizeof(registration));
+        registration.ring_addr = reinterpret_cast<__u64>(buffer_ring);
+        registration.ring_entries = buffer_count;
+        registration.bgid = 0;
+        if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING,
+                &registration, 1) == -1)
+            throw std::runtime_error("io_uring buffer ring not supported");
+        for (unsigned short i = 0; i < buffer_count; i++)
+            provide_buffer(i);
+    } catch (...) {
+        close_ring();
+        throw;
+    }
+}
+
+
+IoUringFastCGIServer::~IoUringFastCGIServer()
+{
+    // nothing the kernel does from now on can reach the sockets
+    close_ring();
+
+    for (std::vector<Socket*>::size_type fd = 0; fd < sockets.size(); ++fd) {
+        if (!sockets[fd])
+            continue;
+        if (!sockets[fd]->closed)
+            close(fd);
+        delete sockets[fd];
+    }
+    // they were the sockets' own
+    connections.clear();
+}
+
+
+void
+IoUringFastCGIServer::close_ring()
+{
+    if (ring_fd != -1)
+        close(ring_fd);
+    ring_fd = -1;
+    if (rings != MAP_FAILED)
+        munmap(rings, rings_size);
+    rings = MAP_FAILED;
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    if (buffer_ring != MAP_FAILED)
+        munmap(buffer_ring, buffer_ring_size);
+    buffer_ring = static_cast<struct io_uring_buf_ring*>(MAP_FAILED);
+    if (buffer_memory != MAP_FAILED)
+        munmap(buffer_memory, buffer_count * receive_buffer_size);
+    buffer_memory = static_cast<char*>(MAP_FAILED);
+}
+
+
+void
+IoUringFastCGIServer::provide_buffer(unsigned short id)
+{
+    // not buffer_ring->bufs, which C++ sees after an empty struct
+    struct io_uring_buf& buffer = reinterpret_cast<struct io_uring_buf*>(
+        buffer_ring)[buffer_tail & (buffer_count - 1)];
+    buffer.addr = reinterpret_cast<__u64>(
+        buffer_memory + id * receive_buffer_size);
+    buffer.len = receive_buffer_size;
+    buffer.bid = id;
+    buffer_tail++;
+    __atomic_store_n(&buffer_ring->tail, buffer_tail, __ATOMIC_RELEASE);
+}
+
+
+struct io_uring_sqe*
+IoUringFastCGIServer::submission()
+{
+    if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+            sq_entries) {
+        enter(false, -1);
+        if (sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) ==
+                sq_entries)
+            throw std::runtime_error("io_uring submission queue full");
+    }
+
+    struct io_uring_sqe* sqe = &sqes[sq_local_tail & sq_mask];
+    bzero(sqe, sizeof(*sqe));
+    sq_local_tail++;
+    return sqe;
+}
+
+
+void
+IoUringFastCGIServer::enter(bool wait, int timeout_ms)
+{
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sq_local_tail - sq_submitted;
+    if (!wait && to_submit == 0)
+        return;
+
+    unsigned flags = 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        bzero(&arg, sizeof(arg));
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+            arg.ts = reinterpret_cast<__u64>(&ts);
+        }
+    }
+
+    enter_calls.store(enter_calls.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    int result = syscall(__NR_io_uring_enter, ring_fd, to_submit,
+        wait ? 1 : 0, flags, wait ? &arg : 0, wait ? sizeof(arg) : 0);
+    if (result >= 0)
+        sq_submitted += result;
+    else if (errno != EINTR && errno != ETIME && errno != EBUSY &&
+            errno != EAGAIN)
+        // EBUSY and EAGAIN mean completions have to be taken first
+        throw std::runtime_error("io_uring_enter() failed");
+}
+
+
+void
+IoUringFastCGIServer::listen(unsigned tcp_port, bool reuse_port)
+{
+    FastCGIServer::listen(tcp_port, reuse_port);
+    start_accepting(listen_sockets.back());
+}
+
+
+void
+IoUringFastCGIServer::listen(const std::string& local_path)
+{
+    FastCGIServer::listen(local_path);
+    start_accepting(listen_sockets.back());
+}
+
+
+void
+IoUringFastCGIServer::listen_descriptor(int listen_socket)
+{
+    FastCGIServer::listen_descriptor(listen_socket);
+    start_accepting(listen_socket);
+}
+
+
+void
+IoUringFastCGIServer::start_accepting(int listen_socket)
+{
+    // it's the ring that waits for connections now, and it would hand back
+    // EAGAIN for a socket that doesn't block
+    poller->remove(listen_socket);
+    int flags = fcntl(listen_socket, F_GETFL);
+    if (flags == -1 ||
+            fcntl(listen_socket, F_SETFL, flags & ~O_NONBLOCK) == -1)
+        throw std::runtime_error("fcntl() failed");
+    arm_accept(listen_socket);
+}
+
+
+void
+IoUringFastCGIServer::arm_accept(int listen_socket)
+{
+    struct io_uring_sqe* sqe = submission();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_socket;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = static_cast<__u64>(listen_socket) << 3 |
+        accept_operation;
+}
+
+
+void
+IoUringFastCGIServer::arm_receive(Socket& socket)
+{
+    struct io_uring_sqe* sqe = submission();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket.connection.read_socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = reinterpret_cast<__u64>(&socket) | receive_operation;
+    socket.receiving = true;
+    socket.pending++;
+}
+
+
+void
+IoUringFastCGIServer::arm_wakeup()
+{
+    struct io_uring_sqe* sqe = submission();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = completions->descriptor();
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = wakeup_operation;
+    wakeup_armed = true;
+}
+
+
+void
+IoUringFastCGIServer::cancel(Socket& socket, bool all)
+{
+    struct io_uring_sqe* sqe = submission();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    if (all) {
+        sqe->fd = socket.connection.read_socket;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    } else
+        sqe->addr = reinterpret_cast<__u64>(&socket) | receive_operation;
+    sqe->user_data = reinterpret_cast<__u64>(&socket) | cancel_operation;
+    socket.cancelling = true;
+    socket.pending++;
+}
+
+
+void
+IoUringFastCGIServer::send(Socket& socket)
+{
+    int count = socket.connection.output_buffer.gather(socket.iov,
+        sizeof(socket.iov) / sizeof(socket.iov[0]), true);
+    socket.offered = 0;
+    for (int i = 0; i < count; i++)
+        socket.offered += socket.iov[i].iov_len;
+    bzero(&socket.message, sizeof(socket.message));
+    socket.message.msg_iov = socket.iov;
+    socket.message.msg_iovlen = count;
+
+    // with MSG_WAITALL the kernel keeps at it until it has all gone out, so
+    // the loop hears back once per flush rather than per partial write
+    struct io_uring_sqe* sqe = submission();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = socket.connection.read_socket;
+    sqe->addr = reinterpret_cast<__u64>(&socket.message);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = reinterpret_cast<__u64>(&socket) | send_operation;
+    socket.sending = true;
+    socket.pending++;
+}
+
+
+void
+IoUringFastCGIServer::process(int timeout_ms)
+{
+    if (!ring_enabled) {
+        if (io_uring_register(ring_fd, IORING_REGISTER_ENABLE_RINGS, 0, 0)
+                == -1)
+            throw std::runtime_error("io_uring_register() failed");
+        ring_enabled = true;
+    }
+    if (completions && !wakeup_armed)
+        arm_wakeup();
+
+    enter(true, wait_timeout(timeout_ms));
+    round_time = now();
+    timers.set_time(round_time);
+
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+        complete(cqe);
+    }
+
+    std::vector<int> expired;
+    expire_timers(expired);
+    for (std::vector<int>::const_iterator it = expired.begin();
+            it != expired.end(); ++it)
+        mark_dirty(*sockets[*it]);
+
+    // once for everything that happened to each connection this round
+    for (std::vector<Socket*>::size_type i = 0; i < dirty.size(); i++)
+        flush(*dirty[i]);
+    dirty.clear();
+}
+
+
+void
+IoUringFastCGIServer::process_forever()
+{
+    for (;;)
+        process();
+}
+
+
+void
+IoUringFastCGIServer::complete(const struct io_uring_cqe& cqe)
+{
+    Operation operation = static_cast<Operation>(cqe.user_data & 7);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (operation == accept_operation) {
+        int listen_socket = cqe.user_data >> 3;
+        if (cqe.res >= 0)
+            accepted(cqe.res);
+        else if (cqe.res == -EINVAL)
+            throw std::runtime_error("io_uring multishot accept not supported");
+        if (!more)
+            arm_accept(listen_socket);
+        return;
+    }
+    if (operation == wakeup_operation) {
+        if (!more)
+            wakeup_armed = false;
+        process_completions();
+        return;
+    }
+
+    Socket& socket = *reinterpret_cast<Socket*>(cqe.user_data & ~7ULL);
+    switch (operation) {
+    case receive_operation:
+        received(socket, cqe);
+        break;
+    case send_operation:
+        socket.sending = false;
+        socket.pending--;
+        if (cqe.res >= 0)
+            sent(socket.connection, cqe.res, socket.offered);
+        else if (cqe.res == -EINTR || cqe.res == -EAGAIN)
+            sent(socket.connection, 0, socket.offered);
+        else
+            socket.connection.reset = true;
+        break;
+    case cancel_operation:
+        socket.cancelling = false;
+        socket.pending--;
+        break;
+    case close_operation:
+        socket.pending--;
+        socket.closed = true;
+        break;
+    default:
+        break;
+    }
+
+    if (socket.closing)
+        close_socket(socket);
+    else
+        mark_dirty(socket);
+}
+
+
+void
+IoUringFastCGIServer::accepted(int read_socket)
+{
+    Socket* socket = 0;
+    try {
+        if (!completions)
+            completions.reset(new CompletionQueue);
+
+        socket = new Socket;
+        if (!admit(socket->connection)) {
+            delete socket;
+            close(read_socket);
+            return;
+        }
+        socket->connection.read_socket = read_socket;
+        socket->connection.output_watermark = output_limit;
+        socket->connection.completer = completions;
+        if (static_cast<std::vector<Socket*>::size_type>(read_socket) >=
+                sockets.size()) {
+            sockets.resize(read_socket + 1);
+            connections.resize(read_socket + 1);
+        }
+        arm_receive(*socket);
+    } catch (...) {
+        delete socket;
+        close(read_socket);
+        throw;
+    }
+    sockets[read_socket] = socket;
+    connections[read_socket] = &socket->connection; // for render_stats
+    update_timers(socket->connection);
+}
+
+
+void
+IoUringFastCGIServer::received(Socket& socket, const struct io_uring_cqe& cqe)
+{
+    Connection& connection = socket.connection;
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        socket.receiving = false;
+        socket.pending--;
+    }
+
+    if (cqe.res > 0) {
+        unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!socket.closing) {
+            std::string::size_type available;
+            char* buffer = connection.input_buffer.prepare(cqe.res,
+                available);
+            // so the buffer can go straight back to the kernel
+            std::memcpy(buffer, buffer_memory + id * receive_buffer_size,
+                cqe.res);
+            connection.input_buffer.commit(cqe.res);
+        }
+        provide_buffer(id);
+        // what arrives while paused, or after the last request, waits
+        if (!socket.closing && !connection.close_socket && !connection.paused)
+            process_connection_read(connection);
+    } else if (cqe.res == 0)
+        connection.close_socket = true;
+    else if (cqe.res == -ECONNRESET)
+        connection.reset = true;
+    else if (cqe.res == -EINVAL)
+        throw std::runtime_error("io_uring multishot receive not supported");
+    else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED)
+        connection.reset = true;
+    // out of buffers or cancelled, flush() arms it again if it should be
+}
+
+
+void
+IoUringFastCGIServer::process_completions()
+{
+    completed.clear();
+    completions->take(completed);
+
+    for (std::vector<std::shared_ptr<FastCGIDeferred::State> >::iterator it =
+            completed.begin(); it != completed.end(); ++it)
+        if (Connection* connection = resume_deferred(**it))
+            mark_dirty(*sockets[connection->read_socket]);
+    completed.clear();
+}
+
+
+void
+IoUringFastCGIServer::mark_dirty(Socket& socket)
+{
+    if (socket.dirty || socket.closing)
+        return;
+    socket.dirty = true;
+    dirty.push_back(&socket);
+}
+
+
+void
+IoUringFastCGIServer::flush(Socket& socket)
+{
+    Connection& connection = socket.connection;
+    socket.dirty = false;
+    if (socket.closing)
+        return;
+
+    if (connection.paused && input_caught_up(connection)) {
+        connection.paused = false;
+        if (!connection.close_socket)
+            process_connection_read(connection);
+    }
+
+    // a send is in flight until everything it was given has gone out, and
+    // its completion brings the connection back here
+    if (!socket.sending && !connection.reset) {
+        wake_drained(connection);
+        process_connection_write(connection);
+        if (!connection.output_buffer.empty())
+            send(socket);
+    }
+
+    if (connection.reset ||
+            (connection.close_socket && connection.drained())) {
+        socket.closing = true;
+        close_socket(socket);
+    } else {
+        if (connection.paused) {
+            if (socket.receiving && !socket.cancelling)
+                cancel(socket, false);
+        } else if (!socket.receiving && !connection.close_socket)
+            arm_receive(socket);
+        update_timers(connection);
+    }
+}
+
+
+void
+IoUringFastCGIServer::close_socket(Socket& socket)
+{
+    int fd = socket.connection.read_socket;
+    if (socket.closed) {
+        if (socket.pending == 0) {
+            sockets[fd] = 0;
+            connections[fd] = 0;
+            delete &socket;
+        }
+        return;
+    }
+
+    // the descriptor only goes once nothing refers to it anymore
+    if ((socket.receiving || socket.sending) && !socket.cancelling)
+        cancel(socket, true);
+    else if (socket.pending == 0) {
+        struct io_uring_sqe* sqe = submission();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = reinterpret_cast<__u64>(&socket) | close_operation;
+        socket.pending++;
+        socket.closed = true;
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * FastCGI server running its loop on a Linux io_uring.
+ */
+
+
+#ifndef FCGICC_URING_H
+#define FCGICC_URING_H
+
+#include "fcgicc.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <linux/io_uring.h>
+
+
+// Same protocol handling as FastCGIServer, but instead of waiting for sockets
+// to become ready and then reading and writing them, the loop hands the
+// operations themselves to the kernel through an io_uring and handles their
+// completions:  one multishot accept per listening socket, one multishot
+// receive per connection into buffers the kernel picks from a ring shared by
+// all of them, and one send of everything queued per flush.  All the
+// operations of a round are submitted together with the wait for the next
+// one, so a busy loop makes a single system call per round however many
+// requests that covers.  Received data is still copied from the kernel's
+// buffer into the connection's own, since a record or parameter may span two
+// of them and the request keeps pointing into its input.  Runs on Linux 6.0
+// and builds against the headers of 6.1, which has IORING_SETUP_DEFER_TASKRUN.
+class IoUringFastCGIServer : protected FastCGIServer {
+public:
+    // entries in the submission queue, and number of 16 KB receive buffers
+    explicit IoUringFastCGIServer(unsigned entries = 1024,
+        unsigned buffers = 256);
+    ~IoUringFastCGIServer();
+
+    using FastCGIServer::request_handler;
+    using FastCGIServer::data_handler;
+    using FastCGIServer::complete_handler;
+    using FastCGIServer::params_map;
+    using FastCGIServer::input_limit;
+    using FastCGIServer::output_watermark;
+    using FastCGIServer::handler_pool;
+    using FastCGIServer::pool_stats;
+    using FastCGIServer::stats;
+    using FastCGIServer::stats_route;
+    using FastCGIServer::idle_timeout;
+    using FastCGIServer::read_timeout;
+    using FastCGIServer::request_timeout;
+    using FastCGIServer::handler_timeout;
+    using FastCGIServer::deadline_param;
+    using FastCGIServer::no_bid_response;
+    using FastCGIServer::overload_target;
+    using FastCGIServer::overload_response;
+    using FastCGIServer::max_connections;
+    using FastCGIServer::max_requests;
+    using FastCGIServer::multiplex;
+    using FastCGIServer::defer;
+
+    using FastCGIServer::listen_backlog;
+    void listen(unsigned tcp_port, bool reuse_port = false);
+    void listen(const std::string& local_path);
+    void listen_descriptor(int listen_socket); // takes ownership
+    using FastCGIServer::abandon_files;
+
+    void process(int timeout_ms = -1); // timeout_ms<0 blocks forever
+    void process_forever();
+
+    // io_uring_enter() calls so far, which is all the loop makes as long as
+    // no deferred requests wake it up
+    unsigned long long system_calls() const {
+        return enter_calls.load(std::memory_order_relaxed);
+    }
+
+protected:
+    // what an operation was for, in the low bits of its user_data
+    enum Operation {
+        accept_operation,
+        receive_operation,
+        send_operation,
+        cancel_operation,
+        close_operation,
+        wakeup_operation
+    };
+
+    // A connection and the operations it has in the ring.  It is only
+    // deleted once the kernel is done with all of them.
+    struct Socket {
+        Socket() :
+            receiving(false), sending(false), cancelling(false),
+            closing(false), closed(false), pending(0), dirty(false),
+            offered(0) {}
+
+        Connection connection;
+        bool receiving; // the multishot receive is armed
+        bool sending;
+        bool cancelling;
+        bool closing; // no more operations but those to close it
+        bool closed; // the descriptor is gone or going
+        unsigned pending; // operations not finished yet
+        bool dirty; // to be flushed at the end of the round
+
+        // the send in flight, which the kernel reads from
+        struct iovec iov[256];
+        struct msghdr message;
+        std::string::size_type offered;
+    };
+
+    void close_ring();
+    void provide_buffer(unsigned short id);
+    struct io_uring_sqe* submission(); // a cleared one
+    // submits what there is, and with wait takes the round's completions
+    void enter(bool wait, int timeout_ms);
+    void complete(const struct io_uring_cqe&);
+
+    void start_accepting(int listen_socket);
+    void arm_accept(int listen_socket);
+    void arm_receive(Socket&);
+    void arm_wakeup();
+    void cancel(Socket&, bool all); // the receive, or everything
+    void send(Socket&);
+    void accepted(int read_socket);
+    void received(Socket&, const struct io_uring_cqe&);
+    void process_completions();
+    void mark_dirty(Socket&);
+    void flush(Socket&);
+    void close_socket(Socket&); // a step further, deletes it once done
+
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_local_tail; // ahead of *sq_tail until submitted
+    unsigned sq_submitted;
+    unsigned cq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    std::size_t rings_size;
+    struct io_uring_sqe* sqes;
+    std::size_t sqes_size;
+    bool ring_enabled;
+
+    // provided buffers, returned to the ring as soon as they are copied out
+    struct io_uring_buf_ring* buffer_ring;
+    std::size_t buffer_ring_size;
+    char* buffer_memory;
+    unsigned buffer_count;
+    unsigned short buffer_tail;
+
+    std::vector<Socket*> sockets; // by descriptor
+    std::vector<Socket*> dirty;
+    bool wakeup_armed;
+    std::atomic<unsigned long long> enter_calls; // written by the loop only
+};
+
+#endif // !FCGICC_URING_H
@@ -0,0 +1,23 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * Minimal assertions for the behaviour tests:  a failed check is reported
+ * and counted, and the test goes on with the next one.
+ */
+
+
+#ifndef FCGICC_TEST_CHECK_H
+#define FCGICC_TEST_CHECK_H
+
+#include <cstdio>
+
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    ((condition) ? (void)0 : (void)(std::fprintf(stderr, "%s:%d: failed: %s\n", \
+        __FILE__, __LINE__, #condition), ++failures))
+
+
+#endif // FCGICC_TEST_CHECK_H
@@ -0,0 +1,245 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * The web server's side of the protocol for the behaviour tests, and a
+ * thread to run a server's loop on meanwhile.
+ */
+
+
+#ifndef FCGICC_TEST_CLIENT_H
+#define FCGICC_TEST_CLIENT_H
+
+#include "fcgicc.h"
+
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fastcgi.h>
+
+
+// A local socket path of its own for each test program
+inline std::string
+test_socket_path(const char* name)
+{
+    return "/tmp/fcgicc-" + std::string(name) + "-" +
+        std::to_string(getpid());
+}
+
+
+// Runs process() on a thread of its own until destroyed
+class ServerThread {
+public:
+    explicit ServerThread(FastCGIServer& p_server) :
+        server(p_server), stopping(false),
+        thread(&ServerThread::run, this) {}
+    ~ServerThread() {
+        stopping = true;
+        thread.join();
+    }
+
+private:
+    void run() {
+        while (!stopping)
+            server.process(10);
+    }
+
+    FastCGIServer& server;
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+
+class TestClient {
+public:
+    struct Response {
+        Response() : out_ended(false), ended(false), app_status(0),
+            protocol_status(0), records_after_end(0) {}
+
+        std::string out;
+        std::string err;
+        bool out_ended; // by an empty FCGI_STDOUT record
+        bool ended;
+        unsigned app_status;
+        unsigned char protocol_status;
+        unsigned records_after_end; // anything but nothing is a bug
+    };
+
+    explicit TestClient(const std::string& path) : closed(false) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1)
+            throw std::runtime_error("socket() failed");
+        struct sockaddr_un address;
+        bzero(&address, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, path.c_str(),
+            sizeof(address.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<struct sockaddr*>(&address),
+                sizeof(address)) == -1) {
+            close(fd);
+            throw std::runtime_error("connect() failed");
+        }
+    }
+    ~TestClient() { close(fd); }
+
+    void record(unsigned char type, unsigned id, const std::string& data) {
+        FCGI_Header header;
+        bzero(&header, sizeof(header));
+        header.version = FCGI_VERSION_1;
+        header.type = type;
+        header.requestIdB1 = (id >> 8) & 0xff;
+        header.requestIdB0 = id & 0xff;
+        header.contentLengthB1 = data.size() >> 8;
+        header.contentLengthB0 = data.size() & 0xff;
+        out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.append(data);
+    }
+
+    static std::string pair(const std::string& name,
+                            const std::string& value) {
+        // short lengths only, which is all the tests need
+        std::string s;
+        s += char(name.size());
+        s += char(value.size());
+        return s + name + value;
+    }
+
+    void begin(unsigned id, bool keep_connection = true) {
+        FCGI_BeginRequestBody body;
+        bzero(&body, sizeof(body));
+        body.roleB0 = FCGI_RESPONDER;
+        body.flags = keep_connection ? FCGI_KEEP_CONN : 0;
+        record(FCGI_BEGIN_REQUEST, id,
+            std::string(reinterpret_cast<const char*>(&body), sizeof(body)));
+    }
+
+    // a whole request with no input, queued to send
+    void request(unsigned id, const std::string& uri,
+                 const std::string& more_params = std::string(),
+                 bool keep_connection = true) {
+        begin(id, keep_connection);
+        record(FCGI_PARAMS, id, pair("REQUEST_URI", uri) + more_params);
+        record(FCGI_PARAMS, id, std::string());
+        record(FCGI_STDIN, id, std::string());
+    }
+
+    void abort(unsigned id) {
+        record(FCGI_ABORT_REQUEST, id, std::string());
+    }
+
+    void send() {
+        std::string::size_type sent = 0;
+        while (sent < out.size()) {
+            ssize_t n = ::send(fd, out.data() + sent, out.size() - sent,
+                MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                break; // the server has closed the connection
+            }
+            sent += n;
+        }
+        out.clear();
+    }
+
+    // reads until every request in ids has ended, the connection has
+    // closed or timeout_ms has passed without anything arriving
+    bool wait(const std::vector<unsigned>& ids, int timeout_ms = 2000) {
+        for (;;) {
+            bool all = true;
+            for (std::vector<unsigned>::const_iterator it = ids.begin();
+                    it != ids.end(); ++it)
+                if (!responses[*it].ended)
+                    all = false;
+            if (all)
+                return true;
+            if (!receive(timeout_ms))
+                return false;
+        }
+    }
+    bool wait(unsigned id, int timeout_ms = 2000) {
+        return wait(std::vector<unsigned>(1, id), timeout_ms);
+    }
+
+    // reads what arrives within timeout_ms;  false on timeout or close
+    bool receive(int timeout_ms) {
+        if (closed)
+            return false;
+        struct pollfd p = { fd, POLLIN, 0 };
+        if (poll(&p, 1, timeout_ms) <= 0)
+            return false;
+        char buffer[65536];
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            closed = true;
+            return false;
+        }
+        in.append(buffer, n);
+        parse();
+        return true;
+    }
+
+    std::map<unsigned, Response> responses;
+    std::string values; // the contents of FCGI_GET_VALUES_RESULT
+    bool closed;
+
+private:
+    void parse() {
+        while (in.size() >= FCGI_HEADER_LEN) {
+            const FCGI_Header& header =
+                *reinterpret_cast<const FCGI_Header*>(in.data());
+            std::string::size_type length =
+                (header.contentLengthB1 << 8) + header.contentLengthB0;
+            std::string::size_type total = FCGI_HEADER_LEN + length +
+                header.paddingLength;
+            if (in.size() < total)
+                return;
+            unsigned id = (header.requestIdB1 << 8) + header.requestIdB0;
+            std::string content(in, FCGI_HEADER_LEN, length);
+
+            if (header.type == FCGI_GET_VALUES_RESULT)
+                values += content;
+            else {
+                Response& response = responses[id];
+                if (response.ended)
+                    response.records_after_end++;
+                else if (header.type == FCGI_STDOUT) {
+                    response.out += content;
+                    if (length == 0)
+                        response.out_ended = true;
+                }
+                else if (header.type == FCGI_STDERR)
+                    response.err += content;
+                else if (header.type == FCGI_END_REQUEST &&
+                        length >= sizeof(FCGI_EndRequestBody)) {
+                    const unsigned char* body =
+                        reinterpret_cast<const unsigned char*>(
+                            content.data());
+                    response.ended = true;
+                    response.app_status = (body[0] << 24) +
+                        (body[1] << 16) + (body[2] << 8) + body[3];
+                    response.protocol_status = body[4];
+                }
+            }
+            in.erase(0, total);
+        }
+    }
+
+    int fd;
+    std::string out;
+    std::string in;
+};
+
+
+#endif // FCGICC_TEST_CLIENT_H
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * Per-request deadlines:  the no-bid response for a request that runs out
+ * of time before or while its handler answers, and status 1 for one that
+ * has already sent part of its response.
+ */
+
+
+#include <fcgicc.h>
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "check.h"
+#include "client.h"
+
+
+static const char no_bid[] = "Status: 204 No Content\r\nX-Bid: none\r\n\r\n";
+
+
+class Application {
+public:
+    Application() : calls(0) {}
+
+    int handle_complete(FastCGIRequest& request) {
+        calls++;
+        std::string_view uri = request.env.get(FastCGIParams::REQUEST_URI);
+        if (uri == "/now") {
+            request.out.append("Content-Type: text/plain\r\n\r\nnow");
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        held.push_back(FastCGIServer::defer(request)); // never answered
+        if (uri == "/partial") {
+            FastCGIWriter writer(request);
+            writer.write("Content-Type: text/plain\r\n\r\npart");
+            writer.flush();
+        }
+        return 0;
+    }
+
+    std::atomic<unsigned> calls;
+    std::mutex mutex;
+    std::vector<FastCGIDeferred> held;
+};
+
+
+int
+main()
+{
+    std::string path = test_socket_path("deadline");
+    FastCGIServer server;
+    Application application;
+    server.complete_handler(application, &Application::handle_complete);
+    server.deadline_param("HTTP_X_TMAX");
+    server.no_bid_response(no_bid);
+    server.listen(path);
+    ServerThread loop(server);
+    TestClient client(path);
+    std::string tmax_50 = TestClient::pair("HTTP_X_TMAX", "50");
+
+    // no deadline, answered as usual however long it takes
+    client.request(1, "/now");
+    client.send();
+    CHECK(client.wait(1));
+    CHECK(client.responses[1].out == "Content-Type: text/plain\r\n\r\nnow");
+
+    // unanswered when its deadline comes
+    auto start = std::chrono::steady_clock::now();
+    client.request(2, "/never", tmax_50);
+    client.send();
+    CHECK(client.wait(2));
+    auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    CHECK(waited >= 45 && waited < 1000);
+    CHECK(client.responses[2].out == no_bid);
+    CHECK(client.responses[2].out_ended);
+    CHECK(client.responses[2].app_status == 0);
+    CHECK(client.responses[2].protocol_status == FCGI_REQUEST_COMPLETE);
+    {
+        // and the handle finds it abandoned
+        std::lock_guard<std::mutex> lock(application.mutex);
+        CHECK(application.held.size() == 1);
+        CHECK(application.held.back().abandoned());
+        application.held.back().complete(0); // does nothing
+    }
+
+    // out of time while its input is still coming, so the handler never
+    // runs, and what comes after is ignored
+    unsigned calls = application.calls;
+    client.begin(3);
+    client.record(FCGI_PARAMS, 3,
+        TestClient::pair("REQUEST_URI", "/now") +
+        TestClient::pair("HTTP_X_TMAX", "10"));
+    client.record(FCGI_PARAMS, 3, std::string());
+    client.send();
+    CHECK(client.wait(3));
+    CHECK(client.responses[3].out == no_bid);
+    CHECK(client.responses[3].out_ended);
+    CHECK(client.responses[3].app_status == 0);
+    client.record(FCGI_STDIN, 3, std::string());
+    client.send();
+    CHECK(application.calls == calls);
+
+    // part of the response has gone out, so no no-bid after it
+    client.request(4, "/partial", tmax_50);
+    client.send();
+    CHECK(client.wait(4));
+    CHECK(client.responses[4].out == "Content-Type: text/plain\r\n\r\npart");
+    CHECK(client.responses[4].out_ended);
+    CHECK(client.responses[4].app_status == 1);
+    CHECK(client.responses[4].protocol_status == FCGI_REQUEST_COMPLETE);
+    CHECK(client.responses[4].records_after_end == 0);
+
+    // the deadline doesn't outlive its request
+    client.request(5, "/now", tmax_50);
+    client.send();
+    CHECK(client.wait(5));
+    CHECK(client.responses[5].out == "Content-Type: text/plain\r\n\r\nnow");
+    client.receive(100);
+    for (std::map<unsigned, TestClient::Response>::iterator it =
+            client.responses.begin(); it != client.responses.end(); ++it)
+        CHECK(it->second.records_after_end == 0);
+    CHECK(client.responses.size() == 5);
+
+    return failures ? 1 : 0;
+}
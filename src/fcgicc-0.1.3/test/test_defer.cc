@@ -0,0 +1,208 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * Deferred responses completed on another thread while the web server
+ * aborts the same requests, and deferred from handlers on a handler pool.
+ */
+
+
+#include <fcgicc.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "check.h"
+#include "client.h"
+
+
+// Completes the handles it is given on a thread of its own
+class Completer {
+public:
+    Completer() : abandoned(0), stopping(false),
+        thread(&Completer::run, this) {}
+    ~Completer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    int handle_complete(FastCGIRequest& request) {
+        std::string_view uri = request.env.get(FastCGIParams::REQUEST_URI);
+        if (uri == "/now") {
+            request.out.append("Content-Type: text/plain\r\n\r\nnow");
+            return 0;
+        }
+        if (uri == "/throw")
+            throw 1; // not an std::exception, on a pool thread
+        if (uri == "/written") {
+            // a writer holds it, and defer() takes it along
+            FastCGIWriter writer(request, 1);
+            writer.write("Content-Type: text/plain\r\n\r\n");
+            CHECK(!writer.full());
+        }
+        FastCGIDeferred handle = FastCGIServer::defer(request);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            handles.push_back(handle);
+        }
+        wakeup.notify_one();
+        return 0;
+    }
+
+    std::atomic<unsigned> abandoned; // seen before completing
+
+private:
+    void run() {
+        unsigned spin = 0;
+        for (;;) {
+            FastCGIDeferred handle;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (handles.empty() && !stopping)
+                    wakeup.wait(lock);
+                if (handles.empty())
+                    return;
+                handle = handles.front();
+                handles.pop_front();
+            }
+            // vary the timing against the abort
+            for (unsigned i = spin++ % 2000; i; i--)
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            if (handle.abandoned())
+                abandoned++;
+            if (handle.out().empty())
+                handle.out().append("Content-Type: text/plain\r\n\r\n");
+            handle.out().append("done");
+            handle.complete(0);
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<FastCGIDeferred> handles;
+    bool stopping;
+    std::thread thread;
+};
+
+
+static void
+aborts()
+{
+    std::string path = test_socket_path("defer");
+    FastCGIServer server;
+    Completer completer;
+    server.complete_handler(completer, &Completer::handle_complete);
+    server.listen(path);
+    ServerThread loop(server);
+
+    TestClient client(path);
+    const unsigned count = 4000;
+    std::vector<unsigned> ids;
+    for (unsigned id = 1; id <= count; id++) {
+        client.request(id, "/later");
+        // abort some right away, and others only after a while
+        if (id % 2 == 0)
+            client.abort(id);
+        client.send();
+        if (id % 3 == 0) {
+            client.receive(0);
+            client.abort(id);
+            client.send();
+        }
+        ids.push_back(id);
+    }
+    CHECK(client.wait(ids, 5000));
+
+    unsigned done = 0, aborted = 0;
+    for (std::vector<unsigned>::iterator it = ids.begin();
+            it != ids.end(); ++it) {
+        TestClient::Response& response = client.responses[*it];
+        CHECK(response.ended);
+        CHECK(response.protocol_status == FCGI_REQUEST_COMPLETE);
+        CHECK(response.records_after_end == 0);
+        if (response.app_status == 0) {
+            CHECK(response.out == "Content-Type: text/plain\r\n\r\ndone");
+            done++;
+        } else {
+            // ended by the abort, the completion went nowhere
+            CHECK(response.app_status == 1);
+            CHECK(response.out.empty());
+            aborted++;
+        }
+        if (*it % 2 && *it % 3)
+            CHECK(response.app_status == 0); // never aborted
+    }
+    CHECK(done + aborted == count);
+    CHECK(aborted > 0);
+    CHECK(completer.abandoned <= aborted);
+
+    // nothing has been left behind to answer later
+    client.receive(200);
+    CHECK(client.responses.size() == count);
+    CHECK(client.responses[0].records_after_end == 0);
+    CHECK(!client.responses[0].ended);
+
+    // and the server still answers
+    client.request(count + 1, "/now");
+    client.request(count + 2, "/later");
+    client.send();
+    std::vector<unsigned> last;
+    last.push_back(count + 1);
+    last.push_back(count + 2);
+    CHECK(client.wait(last));
+    CHECK(client.responses[count + 1].out ==
+        "Content-Type: text/plain\r\n\r\nnow");
+    CHECK(client.responses[count + 2].app_status == 0);
+}
+
+
+static void
+pooled()
+{
+    std::string path = test_socket_path("defer-pooled");
+    FastCGIHandlerPool pool(4);
+    FastCGIServer server;
+    Completer completer;
+    server.complete_handler(completer, &Completer::handle_complete);
+    server.handler_pool(&pool);
+    server.listen(path);
+    ServerThread loop(server);
+
+    TestClient client(path);
+    const unsigned count = 200;
+    std::vector<unsigned> ids;
+    for (unsigned id = 1; id <= count; id++) {
+        const char* uris[] = { "/now", "/later", "/written" };
+        client.request(id, uris[id % 3]);
+        ids.push_back(id);
+    }
+    client.send();
+    client.request(count + 1, "/throw");
+    client.send();
+    CHECK(client.wait(ids, 5000));
+    CHECK(client.wait(count + 1));
+    CHECK(client.responses[count + 1].app_status == 1);
+    for (std::vector<unsigned>::iterator it = ids.begin();
+            it != ids.end(); ++it) {
+        TestClient::Response& response = client.responses[*it];
+        CHECK(response.app_status == 0);
+        CHECK(response.records_after_end == 0);
+        std::string body = *it % 3 ? "done" : "now";
+        CHECK(response.out == "Content-Type: text/plain\r\n\r\n" + body);
+    }
+}
+
+
+int
+main()
+{
+    aborts();
+    pooled();
+    return failures ? 1 : 0;
+}
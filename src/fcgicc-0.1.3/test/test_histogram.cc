@@ -0,0 +1,129 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * FastCGIHistogram buckets and percentiles at their edges.
+ */
+
+
+#include <fcgicc.h>
+
+#include <vector>
+
+#include "check.h"
+
+
+static void
+buckets()
+{
+    // exact below 16
+    for (unsigned long long v = 0; v < 16; v++) {
+        CHECK(FastCGIHistogram::bucket(v) == v);
+        CHECK(FastCGIHistogram::lowest(v) == v);
+    }
+
+    // every value falls between the lowest of its bucket and of the next,
+    // which are 1/16 of it apart at most;  check either side of the powers
+    // of two and a few in between
+    std::vector<unsigned long long> values;
+    for (unsigned shift = 4; shift < 64; shift++) {
+        unsigned long long p = 1ULL << shift;
+        values.push_back(p - 1);
+        values.push_back(p);
+        values.push_back(p + 1);
+        values.push_back(p + p / 3);
+    }
+    values.push_back(~0ULL);
+    for (std::vector<unsigned long long>::iterator it = values.begin();
+            it != values.end(); ++it) {
+        unsigned long long v = *it;
+        unsigned b = FastCGIHistogram::bucket(v);
+        CHECK(b < FastCGIHistogram::buckets);
+        CHECK(FastCGIHistogram::lowest(b) <= v);
+        if (b + 1 < FastCGIHistogram::buckets) {
+            CHECK(v < FastCGIHistogram::lowest(b + 1));
+            CHECK(FastCGIHistogram::lowest(b + 1) - FastCGIHistogram::lowest(b)
+                <= v / 16 + 1);
+        }
+        // a bucket's lowest value is in that bucket
+        CHECK(FastCGIHistogram::bucket(FastCGIHistogram::lowest(b)) == b);
+    }
+
+    // the largest value takes the last bucket
+    CHECK(FastCGIHistogram::bucket(~0ULL) == FastCGIHistogram::buckets - 1);
+    CHECK(FastCGIHistogram::bucket(16) == 16);
+    CHECK(FastCGIHistogram::bucket(31) == 31);
+    CHECK(FastCGIHistogram::bucket(32) == 32);
+    CHECK(FastCGIHistogram::bucket(33) == 32); // two values per bucket
+}
+
+
+static void
+percentiles()
+{
+    FastCGIHistogram histogram;
+    CHECK(histogram.count() == 0);
+    CHECK(histogram.percentile(50) == 0); // nothing recorded
+
+    // one value:  every percentile is the top of its bucket
+    histogram.record(1000);
+    unsigned top = FastCGIHistogram::bucket(1000) + 1;
+    CHECK(histogram.percentile(0) == FastCGIHistogram::lowest(top) - 1);
+    CHECK(histogram.percentile(100) == FastCGIHistogram::lowest(top) - 1);
+    CHECK(histogram.percentile(100) >= 1000);
+    CHECK(histogram.percentile(100) <= 1000 + 1000 / 16);
+    CHECK(histogram.sum == 1000);
+
+    // the exact range
+    histogram.clear();
+    for (unsigned long long v = 0; v < 16; v++)
+        histogram.record(v);
+    CHECK(histogram.count() == 16);
+    CHECK(histogram.percentile(0) == 0);
+    CHECK(histogram.percentile(50) == 8);
+    CHECK(histogram.percentile(99.9) == 15);
+    CHECK(histogram.percentile(100) == 15); // not past the last one
+    CHECK(histogram.percentile(200) == 15);
+
+    // a tail of one in a thousand shows at the 99.9th only
+    histogram.clear();
+    for (unsigned i = 0; i < 999; i++)
+        histogram.record(10);
+    histogram.record(1000000);
+    CHECK(histogram.percentile(99) == 10);
+    CHECK(histogram.percentile(99.8) == 10);
+    CHECK(histogram.percentile(99.9) >= 1000000);
+    CHECK(histogram.percentile(99.9) <= 1000000 + 1000000 / 16);
+
+    // the top bucket has no upper bound
+    histogram.clear();
+    histogram.record(~0ULL);
+    CHECK(histogram.percentile(50) == ~0ULL);
+}
+
+
+static void
+merging()
+{
+    FastCGIHistogram a, b;
+    for (unsigned i = 0; i < 100; i++)
+        a.record(5);
+    for (unsigned i = 0; i < 300; i++)
+        b.record(500);
+    a.merge(b);
+    CHECK(a.count() == 400);
+    CHECK(a.sum == 100 * 5 + 300 * 500);
+    CHECK(a.percentile(24) == 5);
+    CHECK(a.percentile(25) >= 500);
+    CHECK(b.count() == 300); // left alone
+}
+
+
+int
+main()
+{
+    buckets();
+    percentiles();
+    merging();
+    return failures ? 1 : 0;
+}
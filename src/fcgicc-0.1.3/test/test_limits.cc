@@ -0,0 +1,227 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * max_connections(), max_requests() and multiplex(false):  what is refused
+ * and how, and what FCGI_GET_VALUES advertises.
+ */
+
+
+#include <fcgicc.h>
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "client.h"
+
+
+class Application {
+public:
+    int handle_complete(FastCGIRequest& request) {
+        if (request.env.get(FastCGIParams::REQUEST_URI) == "/hold") {
+            std::lock_guard<std::mutex> lock(mutex);
+            held.push_back(FastCGIServer::defer(request));
+            return 0;
+        }
+        request.out.append("Content-Type: text/plain\r\n\r\nok");
+        return 0;
+    }
+
+    // answers the oldest held request
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (held.empty())
+            return;
+        held.front().out().append("Content-Type: text/plain\r\n\r\nheld");
+        held.front().complete(0);
+        held.erase(held.begin());
+    }
+
+    unsigned holding() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return held.size();
+    }
+
+    std::mutex mutex;
+    std::vector<FastCGIDeferred> held;
+};
+
+
+static FastCGIParams
+get_values(TestClient& client)
+{
+    client.record(FCGI_GET_VALUES, 0,
+        TestClient::pair(FCGI_MAX_CONNS, "") +
+        TestClient::pair(FCGI_MAX_REQS, "") +
+        TestClient::pair(FCGI_MPXS_CONNS, ""));
+    client.send();
+    client.values.clear();
+    while (client.values.empty() && client.receive(2000))
+        ;
+    FastCGIParams values;
+    values.parse(client.values.data(), client.values.size());
+    return values;
+}
+
+
+static void
+limits()
+{
+    std::string path = test_socket_path("limits");
+    FastCGIServer server;
+    Application application;
+    server.complete_handler(application, &Application::handle_complete);
+    server.max_connections(2);
+    server.max_requests(3);
+    server.listen(path);
+    FastCGIServer::Stats before = FastCGIServer::stats();
+    ServerThread loop(server);
+
+    TestClient a(path);
+    FastCGIParams values = get_values(a);
+    CHECK(values.get(FCGI_MAX_CONNS) == "2");
+    CHECK(values.get(FCGI_MAX_REQS) == "3");
+    CHECK(values.get(FCGI_MPXS_CONNS) == "1");
+
+    // a third connection is closed as soon as it is accepted
+    {
+        TestClient b(path);
+        b.request(1, "/");
+        b.send();
+        CHECK(b.wait(1));
+        TestClient c(path);
+        c.request(1, "/");
+        c.send();
+        CHECK(!c.wait(1));
+        CHECK(c.closed);
+        CHECK(c.responses[1].out.empty());
+    }
+
+    // and once one has gone, another may take its place, as soon as the
+    // server has noticed
+    std::unique_ptr<TestClient> d;
+    for (unsigned attempt = 0; attempt < 50; attempt++) {
+        d.reset(new TestClient(path));
+        d->request(1, "/");
+        d->send();
+        if (d->wait(1, 100))
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    CHECK(d->responses[1].ended);
+    CHECK(d->responses[1].out == "Content-Type: text/plain\r\n\r\nok");
+
+    // three requests open at once over the connections, then no more
+    a.request(1, "/hold");
+    a.request(2, "/hold");
+    d->request(2, "/hold");
+    a.send();
+    d->send();
+    for (unsigned i = 0; i < 100 && application.holding() < 3; i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(application.holding() == 3);
+    a.request(3, "/");
+    a.send();
+    CHECK(a.wait(3));
+    CHECK(a.responses[3].protocol_status == FCGI_OVERLOADED);
+    CHECK(a.responses[3].out.empty());
+
+    // one answered, so there is room for one more
+    application.release();
+    for (unsigned i = 0; i < 100; i++) {
+        a.receive(10);
+        d->receive(10);
+        if (a.responses[1].ended || a.responses[2].ended ||
+                d->responses[2].ended)
+            break;
+    }
+    a.request(4, "/");
+    a.send();
+    CHECK(a.wait(4));
+    CHECK(a.responses[4].protocol_status == FCGI_REQUEST_COMPLETE);
+    CHECK(a.responses[4].out == "Content-Type: text/plain\r\n\r\nok");
+
+    application.release();
+    application.release();
+    std::vector<unsigned> ids;
+    ids.push_back(1);
+    ids.push_back(2);
+    CHECK(a.wait(ids));
+    CHECK(d->wait(2));
+    CHECK(a.responses[1].out == "Content-Type: text/plain\r\n\r\nheld");
+    CHECK(d->responses[2].out == "Content-Type: text/plain\r\n\r\nheld");
+
+    FastCGIServer::Stats after = FastCGIServer::stats();
+    CHECK(after.connections_refused - before.connections_refused >= 1);
+    CHECK(after.requests_refused - before.requests_refused == 1);
+}
+
+
+static void
+no_multiplexing()
+{
+    std::string path = test_socket_path("single");
+    FastCGIServer server;
+    Application application;
+    server.complete_handler(application, &Application::handle_complete);
+    server.multiplex(false);
+    server.max_connections(10);
+    server.listen(path);
+    ServerThread loop(server);
+
+    TestClient client(path);
+    FastCGIParams values = get_values(client);
+    CHECK(values.get(FCGI_MAX_CONNS) == "10");
+    CHECK(values.get(FCGI_MAX_REQS) == "10"); // one on each
+    CHECK(values.get(FCGI_MPXS_CONNS) == "0");
+
+    client.request(1, "/hold");
+    client.send();
+    client.receive(50);
+    client.request(2, "/");
+    client.send();
+    CHECK(client.wait(2));
+    CHECK(client.responses[2].protocol_status == FCGI_CANT_MPX_CONN);
+    CHECK(!client.responses[1].ended);
+
+    // one after the other is fine
+    application.release();
+    CHECK(client.wait(1));
+    CHECK(client.responses[1].protocol_status == FCGI_REQUEST_COMPLETE);
+    client.request(3, "/");
+    client.send();
+    CHECK(client.wait(3));
+    CHECK(client.responses[3].out == "Content-Type: text/plain\r\n\r\nok");
+}
+
+
+static void
+unlimited()
+{
+    std::string path = test_socket_path("unlimited");
+    FastCGIServer server;
+    server.max_connections(10);
+    server.listen(path);
+    ServerThread loop(server);
+
+    // any number of requests on each connection isn't worth advertising
+    TestClient client(path);
+    FastCGIParams values = get_values(client);
+    CHECK(values.get(FCGI_MAX_CONNS) == "10");
+    CHECK(!values.has(FCGI_MAX_REQS));
+    CHECK(values.get(FCGI_MPXS_CONNS) == "1");
+}
+
+
+int
+main()
+{
+    limits();
+    no_multiplexing();
+    unlimited();
+    return failures ? 1 : 0;
+}
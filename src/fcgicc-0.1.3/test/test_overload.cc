@@ -0,0 +1,210 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * Shedding load under overload_target():  when the server judges a queue
+ * standing, and what the requests it sheds get back.
+ */
+
+
+#include <fcgicc.h>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "check.h"
+#include "client.h"
+
+
+struct Internals : FastCGIServer {
+    using FastCGIServer::OverloadControl;
+};
+typedef Internals::OverloadControl OverloadControl;
+
+static const unsigned long long ms = 1000000;
+
+
+static void
+control()
+{
+    OverloadControl overload;
+    CHECK(!overload.shed(1000 * ms, 1)); // off until configured
+
+    overload.configure(5 * ms, 100 * ms);
+    unsigned long long t = 1000 * ms;
+
+    // the first interval only starts the count
+    CHECK(!overload.shed(50 * ms, t));
+    CHECK(!overload.shed(50 * ms, t + 50 * ms));
+    CHECK(!overload.overloaded());
+
+    // a whole interval without a wait under the target is a standing queue
+    t += 100 * ms;
+    CHECK(overload.shed(50 * ms, t));
+    CHECK(overload.overloaded());
+    CHECK(overload.shed(11 * ms, t + 1 * ms));
+    CHECK(!overload.shed(10 * ms, t + 2 * ms)); // only just over, kept
+    CHECK(!overload.shed(1 * ms, t + 3 * ms));
+
+    // one short wait in the interval is enough to clear it
+    t += 100 * ms;
+    CHECK(!overload.shed(50 * ms, t));
+    CHECK(!overload.overloaded());
+
+    // a burst that passes within an interval isn't shed
+    CHECK(!overload.shed(2 * ms, t + 10 * ms));
+    CHECK(!overload.shed(80 * ms, t + 90 * ms));
+    t += 100 * ms;
+    CHECK(!overload.shed(80 * ms, t));
+    CHECK(!overload.overloaded());
+
+    // and the judgement holds until the next interval is over
+    CHECK(!overload.shed(30 * ms, t + 50 * ms));
+    t += 100 * ms;
+    CHECK(overload.shed(30 * ms, t));
+    CHECK(overload.shed(30 * ms, t + 99 * ms));
+}
+
+
+class Application {
+public:
+    int handle_data(FastCGIRequest& request) {
+        // left for the server to send along with whatever the answer is
+        if (!request.in.empty())
+            request.err.append("read ");
+        request.in.clear();
+        return 0;
+    }
+
+    int handle_complete(FastCGIRequest& request) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        request.out.append("Content-Type: text/plain\r\n\r\n");
+        request.out.append(request.env.get(FastCGIParams::REQUEST_URI));
+        return 0;
+    }
+};
+
+
+static void
+pipelined()
+{
+    static const char overloaded[] = "Status: 503 Service Unavailable\r\n\r\n";
+    std::string path = test_socket_path("overload");
+    FastCGIServer server;
+    Application application;
+    server.data_handler(application, &Application::handle_data);
+    server.complete_handler(application, &Application::handle_complete);
+    server.overload_target(5);
+    server.overload_response(overloaded);
+    server.listen(path);
+    unsigned long long shed_before = FastCGIServer::stats().shed;
+    ServerThread loop(server);
+
+    // all at once, so that each waits for the handlers of those before it
+    TestClient client(path);
+    const unsigned count = 40;
+    std::vector<unsigned> ids;
+    for (unsigned id = 1; id <= count; id++) {
+        client.begin(id);
+        client.record(FCGI_PARAMS, id,
+            TestClient::pair("REQUEST_URI", "/" + std::to_string(id)));
+        client.record(FCGI_PARAMS, id, std::string());
+        client.record(FCGI_STDIN, id, "x");
+        client.record(FCGI_STDIN, id, std::string());
+        ids.push_back(id);
+    }
+    client.send();
+    CHECK(client.wait(ids, 5000));
+
+    unsigned answered = 0, shed = 0;
+    for (std::vector<unsigned>::iterator it = ids.begin();
+            it != ids.end(); ++it) {
+        TestClient::Response& response = client.responses[*it];
+        CHECK(response.ended);
+        CHECK(response.app_status == 0);
+        CHECK(response.records_after_end == 0);
+        CHECK(response.err == "read "); // sent either way
+        if (response.out == overloaded)
+            shed++;
+        else {
+            // its own answer, under its own ID
+            CHECK(response.out == "Content-Type: text/plain\r\n\r\n/" +
+                std::to_string(*it));
+            answered++;
+            CHECK(shed == 0); // once shedding starts it sheds the rest
+        }
+    }
+    CHECK(answered + shed == count);
+    CHECK(answered > 0);
+    CHECK(shed > 0);
+    CHECK(FastCGIServer::stats().shed - shed_before == shed);
+    CHECK(client.responses.size() == count);
+
+    // the queue has gone, so a request on its own is answered
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    client.request(count + 1, "/alone");
+    client.send();
+    CHECK(client.wait(count + 1));
+    client.request(count + 2, "/again");
+    client.send();
+    CHECK(client.wait(count + 2));
+    CHECK(client.responses[count + 2].out ==
+        "Content-Type: text/plain\r\n\r\n/again");
+}
+
+
+static void
+connections()
+{
+    // one request on each of many connections, as a web server usually
+    // sends them, which all wait for the handlers run before them in the
+    // same round of the loop
+    static const char overloaded[] = "Status: 503 Service Unavailable\r\n\r\n";
+    std::string path = test_socket_path("overload-connections");
+    FastCGIServer server;
+    Application application;
+    server.complete_handler(application, &Application::handle_complete);
+    server.overload_target(5);
+    server.overload_response(overloaded);
+    server.listen(path);
+    ServerThread loop(server);
+
+    const unsigned count = 40;
+    std::vector<std::unique_ptr<TestClient> > clients;
+    for (unsigned i = 0; i < count; i++)
+        clients.push_back(std::unique_ptr<TestClient>(new TestClient(path)));
+    for (unsigned i = 0; i < count; i++) {
+        clients[i]->request(1, "/" + std::to_string(i));
+        clients[i]->send();
+    }
+
+    unsigned answered = 0, shed = 0;
+    for (unsigned i = 0; i < count; i++) {
+        TestClient& client = *clients[i];
+        CHECK(client.wait(1, 5000));
+        TestClient::Response& response = client.responses[1];
+        CHECK(response.app_status == 0);
+        if (response.out == overloaded)
+            shed++;
+        else {
+            CHECK(response.out == "Content-Type: text/plain\r\n\r\n/" +
+                std::to_string(i));
+            answered++;
+        }
+    }
+    CHECK(answered + shed == count);
+    CHECK(answered > 0);
+    CHECK(shed > 0);
+}
+
+
+int
+main()
+{
+    control();
+    pipelined();
+    connections();
+    return failures ? 1 : 0;
+}
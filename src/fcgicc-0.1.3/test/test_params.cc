@@ -0,0 +1,137 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * FastCGIParams::parse on well-formed, long and malformed name-value pairs.
+ */
+
+
+#include <fcgicc.h>
+
+#include <string>
+
+#include "check.h"
+
+
+static std::string
+length(std::string::size_type n, bool long_form)
+{
+    std::string s;
+    if (long_form || n > 127) {
+        s += char(0x80 | (n >> 24));
+        s += char((n >> 16) & 0xff);
+        s += char((n >> 8) & 0xff);
+        s += char(n & 0xff);
+    } else
+        s += char(n);
+    return s;
+}
+
+
+static std::string
+pair(const std::string& name, const std::string& value,
+     bool long_name = false, bool long_value = false)
+{
+    return length(name.size(), long_name) + length(value.size(), long_value) +
+        name + value;
+}
+
+
+static void
+well_formed()
+{
+    std::string data = pair("REQUEST_URI", "/x?a=1") +
+        pair("QUERY_STRING", "a=1") + pair("X_OTHER", "") +
+        pair("REQUEST_URI", "/second");
+    FastCGIParams params;
+    params.parse(data.data(), data.size());
+
+    CHECK(params.size() == 4);
+    CHECK(params.has(FastCGIParams::REQUEST_URI));
+    CHECK(params.get(FastCGIParams::REQUEST_URI) == "/x?a=1"); // first wins
+    CHECK(params.get(FastCGIParams::QUERY_STRING) == "a=1");
+    CHECK(!params.has(FastCGIParams::HTTP_HOST));
+    CHECK(params.get(FastCGIParams::HTTP_HOST).empty());
+    CHECK(params.has("X_OTHER"));
+    CHECK(params.get("X_OTHER").empty());
+    CHECK(!params.has("X_MISSING"));
+
+    // views point into the data, nothing is copied
+    CHECK(params.get("QUERY_STRING").data() >= data.data() &&
+        params.get("QUERY_STRING").data() < data.data() + data.size());
+
+    // parsing again forgets what was there
+    std::string other = pair("HTTP_HOST", "example.com");
+    params.parse(other.data(), other.size());
+    CHECK(params.size() == 1);
+    CHECK(!params.has(FastCGIParams::REQUEST_URI));
+    CHECK(params.get(FastCGIParams::HTTP_HOST) == "example.com");
+}
+
+
+static void
+four_byte_lengths()
+{
+    // 4-byte lengths where a short one would do are just as valid
+    std::string data = pair("HTTP_HOST", "h", true, false) +
+        pair("SERVER_NAME", "s", false, true) +
+        pair("REQUEST_URI", "/u", true, true);
+    std::string big(300, 'c');
+    data += pair("HTTP_COOKIE", big); // takes the long form
+    FastCGIParams params;
+    params.parse(data.data(), data.size());
+
+    CHECK(params.size() == 4);
+    CHECK(params.get(FastCGIParams::HTTP_HOST) == "h");
+    CHECK(params.get(FastCGIParams::SERVER_NAME) == "s");
+    CHECK(params.get(FastCGIParams::REQUEST_URI) == "/u");
+    CHECK(params.get(FastCGIParams::HTTP_COOKIE) == big);
+
+    // the top bit only marks the form, it isn't part of the length
+    std::string marked = pair("REQUEST_METHOD", "GET", true, true);
+    CHECK(static_cast<unsigned char>(marked[0]) == 0x80);
+    params.parse(marked.data(), marked.size());
+    CHECK(params.get(FastCGIParams::REQUEST_METHOD) == "GET");
+}
+
+
+static void
+malformed()
+{
+    std::string good = pair("REQUEST_URI", "/ok");
+    FastCGIParams params;
+
+    // every truncation of a pair after a good one keeps only the good one
+    std::string bad = pair("HTTP_HOST", "example.com", true, true);
+    for (std::string::size_type n = 1; n < bad.size(); n++) {
+        std::string data = good + bad.substr(0, n);
+        params.parse(data.data(), data.size());
+        CHECK(params.size() == 1);
+        CHECK(params.get(FastCGIParams::REQUEST_URI) == "/ok");
+        CHECK(!params.has(FastCGIParams::HTTP_HOST));
+    }
+
+    // lengths past the end, even huge ones, stop parsing without reading
+    // past it
+    std::string huge = good + "\xff\xff\xff\xff\x01" "ab";
+    params.parse(huge.data(), huge.size());
+    CHECK(params.size() == 1);
+    std::string long_value = good + "\x02\xff\xff\xff\xff" "ab";
+    params.parse(long_value.data(), long_value.size());
+    CHECK(params.size() == 1);
+
+    // nothing at all
+    params.parse(good.data(), 0);
+    CHECK(params.size() == 0);
+    CHECK(!params.has(FastCGIParams::REQUEST_URI));
+}
+
+
+int
+main()
+{
+    well_formed();
+    four_byte_lengths();
+    malformed();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * This file is part of the FastCGI C++ Class library (fcgicc) and is
+ * distributed under the same terms, see LICENSE.txt.
+ *
+ * The timing wheel behind FastCGIServer's deadlines, on a simulated clock:
+ * timers expire on their tick however many levels they cascade through, and
+ * timeout() never sleeps past the next one.
+ */
+
+
+#include <fcgicc.h>
+
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "check.h"
+
+
+// the wheel is internal to the server
+struct Internals : FastCGIServer {
+    using FastCGIServer::TimerWheel;
+    using FastCGIServer::Timer;
+    using FastCGIServer::now;
+};
+typedef Internals::TimerWheel TimerWheel;
+typedef Internals::Timer Timer;
+
+
+// A wheel whose clock the test moves
+class Clock {
+public:
+    Clock() : tick(Internals::now() / 1000000) {
+        set(tick); // catches the wheel up with it
+    }
+
+    void set(unsigned long long t) {
+        tick = t;
+        wheel.set_time(tick * 1000000);
+    }
+
+    TimerWheel wheel;
+    unsigned long long tick;
+};
+
+
+struct Expected {
+    std::unique_ptr<Timer> timer;
+    unsigned long long expiry; // tick
+    unsigned long long fired; // tick, 0 until then
+};
+
+
+static Timer*
+new_timer()
+{
+    return new Timer(Timer::request_deadline, 0, 0);
+}
+
+
+// collects what expires at the clock's tick;  false if anything expires
+// that isn't in timers or expires early
+static bool
+collect(Clock& clock, std::vector<Expected>& timers)
+{
+    bool ok = true;
+    while (Timer* timer = clock.wheel.expire()) {
+        bool found = false;
+        for (std::vector<Expected>::iterator it = timers.begin();
+                it != timers.end(); ++it)
+            if (it->timer.get() == timer) {
+                found = true;
+                ok = ok && !it->fired && clock.tick >= it->expiry;
+                it->fired = clock.tick;
+            }
+        ok = ok && found && !timer->armed();
+    }
+    return ok;
+}
+
+
+// moves the clock by timeout() until nothing is left, and checks that each
+// timer expired exactly on its tick;  returns the number of steps
+static unsigned
+run_by_timeout(Clock& clock, std::vector<Expected>& timers)
+{
+    unsigned steps = 0;
+    for (;;) {
+        CHECK(collect(clock, timers));
+        int timeout = clock.wheel.timeout();
+        if (timeout < 0)
+            break;
+        CHECK(timeout > 0); // expired all that was due
+        clock.set(clock.tick + timeout);
+        if (++steps > 100000)
+            break;
+    }
+    for (std::vector<Expected>::iterator it = timers.begin();
+            it != timers.end(); ++it)
+        CHECK(it->fired == it->expiry);
+    return steps;
+}
+
+
+static void
+levels()
+{
+    // around the edges of every level
+    Clock clock;
+    std::vector<Expected> timers;
+    unsigned long long delays[] = {
+        1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 262143, 262144,
+        262145, 16777215, 16777216, 16777217, 1073741823, 1073741824,
+        1073741825, 4294967295ULL
+    };
+    for (unsigned i = 0; i < sizeof(delays) / sizeof(delays[0]); i++) {
+        Expected e;
+        e.timer.reset(new_timer());
+        e.expiry = clock.tick + delays[i];
+        e.fired = 0;
+        clock.wheel.arm(*e.timer, delays[i]);
+        timers.push_back(std::move(e));
+    }
+    unsigned steps = run_by_timeout(clock, timers);
+    // woken only to expire or move down, at most once a level each
+    CHECK(steps <= timers.size() * TimerWheel::levels);
+}
+
+
+static void
+beyond_the_top()
+{
+    // more than a whole turn of the top level away, so it waits there and
+    // must not expire when the top level comes round to its slot
+    Clock clock;
+    std::vector<Expected> timers;
+    unsigned long long turn = 1ULL << (TimerWheel::levels *
+        TimerWheel::slot_bits);
+    unsigned long long ticks[] = { turn + 5, 3 * turn + 4097, turn - 1 };
+    for (unsigned i = 0; i < 3; i++) {
+        Expected e;
+        e.timer.reset(new_timer());
+        e.expiry = clock.tick + ticks[i];
+        e.fired = 0;
+        clock.wheel.arm_by(*e.timer, e.expiry * 1000000);
+        timers.push_back(std::move(e));
+    }
+    run_by_timeout(clock, timers);
+}
+
+
+static void
+random_jumps()
+{
+    // the loop doesn't wake up on time:  every timer expires on the first
+    // expire() at or after its tick, never before
+    Clock clock;
+    std::vector<Expected> timers;
+    std::srand(1);
+    for (unsigned i = 0; i < 5000; i++) {
+        Expected e;
+        e.timer.reset(new_timer());
+        unsigned ms = 1 + std::rand() % (1 << (std::rand() % 28));
+        e.expiry = clock.tick + ms;
+        e.fired = 0;
+        clock.wheel.arm(*e.timer, ms);
+        timers.push_back(std::move(e));
+    }
+    unsigned long long last = clock.tick + (1 << 28);
+    unsigned long long previous = clock.tick;
+    while (clock.tick < last) {
+        clock.set(clock.tick + 1 + std::rand() % (1 << (std::rand() % 22)));
+        unsigned long long now = clock.tick;
+        CHECK(collect(clock, timers));
+        for (std::vector<Expected>::iterator it = timers.begin();
+                it != timers.end(); ++it)
+            if (it->fired == now)
+                CHECK(it->expiry > previous); // not late either
+        previous = now;
+    }
+    CHECK(clock.wheel.timeout() == -1);
+    for (std::vector<Expected>::iterator it = timers.begin();
+            it != timers.end(); ++it)
+        CHECK(it->fired != 0);
+}
+
+
+static void
+rearm_and_cancel()
+{
+    Clock clock;
+    std::vector<Expected> timers;
+    Expected e;
+    e.timer.reset(new_timer());
+    e.fired = 0;
+    timers.push_back(std::move(e));
+    Timer& timer = *timers[0].timer;
+
+    // arm() moves it either way, arm_by() only ever sooner
+    clock.wheel.arm(timer, 5000);
+    clock.wheel.arm(timer, 100);
+    CHECK(timer.armed());
+    clock.wheel.arm_by(timer, (clock.tick + 200) * 1000000);
+    clock.wheel.arm_by(timer, (clock.tick + 50) * 1000000 - 1); // rounds up
+    // in the past, it is due on the next tick
+    Timer late(Timer::read_deadline, 0, 0);
+    clock.wheel.arm_by(late, 0);
+    CHECK(late.armed());
+    CHECK(clock.wheel.timeout() == 1);
+    late.cancel();
+    CHECK(!late.armed());
+    late.cancel(); // twice is harmless
+
+    timers[0].expiry = clock.tick + 50;
+    run_by_timeout(clock, timers);
+
+    // cancelled, it leaves nothing behind
+    clock.wheel.arm(timer, 70000);
+    CHECK(clock.wheel.timeout() > 0);
+    timer.cancel();
+    CHECK(clock.wheel.timeout() == -1);
+    clock.set(clock.tick + 100000);
+    CHECK(clock.wheel.expire() == 0);
+
+    // nor does a timer that goes away while armed
+    {
+        Timer gone(Timer::idle_deadline, 0, 0);
+        clock.wheel.arm(gone, 10);
+    }
+    CHECK(clock.wheel.timeout() == -1);
+}
+
+
+int
+main()
+{
+    levels();
+    beyond_the_top();
+    random_jumps();
+    rearm_and_cancel();
+    return failures ? 1 : 0;
+}
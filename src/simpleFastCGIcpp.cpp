@@ -14,7 +14,7 @@ int handle_request(FastCGIRequest& request) {
     // server receives all parameters.  There may be more data coming on the
     // standard input stream.
 
-    if (request.params.count("REQUEST_URI"))
+    if (request.env.has(FastCGIParams::REQUEST_URI))
 	return 0;  // OK, continue processing
     else
 	return 1;  // Stop processing and return error code
@@ -40,18 +40,15 @@ class Application {
 public:
     int handle_complete(FastCGIRequest& request) {
 
-	static const std::string REQUEST_URI {"REQUEST_URI"};
-	static const std::string REQUEST_BODY {"REQUEST_BODY"};
-
 	// The event handler can also be a class member function.  This
 	// event occurs when the parameters and standard input streams are
 	// both closed, and thus the request is complete.
 
 	request.out.append("Content-Type: application/json\r\n\r\n");
 	request.out.append("{");
-	if(request.params.count("REQUEST_BODY"))
+	if(request.env.has(FastCGIParams::REQUEST_BODY))
 	{
-		const std::string& body {request.params[REQUEST_BODY]};
+		std::string_view body {request.env.get(FastCGIParams::REQUEST_BODY)};
 		if( not body.empty() ) {
 			request.out.append("\"id\":\"FxAaGosSaM\"");
 		}
@@ -65,21 +62,24 @@ bool SimpleFastCGIcpp::helloWorld()
 {
 	// Backup the stdio streambufs
 	Application application;
+	//FastCGIHandlerPool pool;  // Threads for slow handlers, must outlive the server
 
-	FastCGIServer server;  // Instantiate a server
+	FastCGIServerGroup server;  // Instantiate one server loop per CPU
 
 	// Set up our request handlers
 	server.request_handler(&handle_request);
 	server.data_handler(&handle_data);
 	server.complete_handler(application, &Application::handle_complete);
+	server.params_map(false);  // handlers only use request.env
+	//server.handler_pool(&pool);  // Run handle_complete there, off the I/O threads
 
-	server.listen(7000);        // Listen on a TCP port
+	server.listen(7000);        // Listen on a TCP port (SO_REUSEPORT per worker)
 	//server.listen(7001);        // ... or on two
 	//server.listen("./socket");  // ... and also on a local doman socket
 
-	//server.process(9999);  // Process some data, but don't wait more than XXX ms for it to arrive.
-	//server.process();  // Process some data with no timeout
-	server.process_forever();  // Process everything
+	//server.worker(0).process(9999);  // Process some data on one worker, but don't wait more than XXX ms for it to arrive.
+	//server.worker(0).process();  // Process some data with no timeout
+	server.process_forever();  // Process everything on all workers
 
     return true;
 }